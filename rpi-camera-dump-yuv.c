@@ -30,12 +30,40 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/auxv.h>
+#if defined(__arm__) && !defined(__ARM_NEON) && !defined(__ARM_NEON__)
+// Raspbian builds for ARMv6 without NEON, so the NEON kernels are built for
+// NEON on their own and only picked at runtime when the CPU has it
+#define NEON_KERNELS_BEGIN _Pragma("GCC push_options") _Pragma("GCC target(\"fpu=neon\")")
+#define NEON_KERNELS_END   _Pragma("GCC pop_options")
+#else
+#define NEON_KERNELS_BEGIN
+#define NEON_KERNELS_END
+#endif
+#if defined(__arm__) || defined(__aarch64__)
+#define HAVE_NEON_KERNELS 1
+NEON_KERNELS_BEGIN
+#include <arm_neon.h>
+NEON_KERNELS_END
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <bcm_host.h>
 
@@ -48,8 +76,8 @@
 #include <IL/OMX_Broadcom.h>
 
 // Hard coded parameters
-#define VIDEO_WIDTH                     1920 / 4
-#define VIDEO_HEIGHT                    1080 / 4
+#define VIDEO_WIDTH                     1920
+#define VIDEO_HEIGHT                    1080
 #define VIDEO_FRAMERATE                 25
 #define CAM_DEVICE_NUMBER               0
 #define CAM_SHARPNESS                   0                       // -100 .. 100
@@ -64,6 +92,37 @@
 #define CAM_IMAGE_FILTER                OMX_ImageFilterNoise    // OMX_IMAGEFILTERTYPE
 #define CAM_FLIP_HORIZONTAL             OMX_FALSE
 #define CAM_FLIP_VERTICAL               OMX_FALSE
+#define CAMERA_OUTPUT_BUFFERS           4                       // at least nBufferCountActual of port 71
+#define FRAME_POOL_SIZE                 8                       // unpacked frames waiting to be written
+#define OUTPUT_FORMAT                   OUTPUT_FORMAT_I420      // I420, NV12, YUY2, RGB24, BGRA, Y or UV
+#define OUTPUT_ALIGNMENT                1                       // bytes, 1 packs the rows tightly, 4 is the GStreamer I420 layout
+#define OUTPUT_ROTATION                 0                       // 0, 90, 180 or 270 degrees clockwise, I420 and Y only
+#define DOWNSCALE_FACTOR                0                       // 2, 4 or 8 writes a reduced copy too, 0 doesn't
+#define DOWNSCALE_FILTER                DOWNSCALE_BOX           // DOWNSCALE_BOX or DOWNSCALE_BILINEAR
+#define DOWNSCALE_OUTPUT                "reduced.yuv"           // I420 of the reduced copy
+#define REGIONS_OF_INTEREST             { }                     // { x, y, width, height, "file.yuv" }, ... I420 streams of their own
+#define FULL_FRAME_OUTPUT               1                       // 0 writes just the regions of interest and the reduced copy
+#define FIXED_LAYOUTS                   1                       // 0 always unpacks with the layout worked out at runtime
+#define UNPACK_BENCHMARK                0                       // 1 benchmarks the unpack kernels and exits
+#define UNPACK_BENCHMARK_FRAMES         200
+#define SCATTER_OUTPUT                  0                       // 1 unpacks straight to a regular output file, without the writer
+#define OUTPUT_MAP_FRAMES               16                      // frames preallocated and mapped at a time
+#define MEMORY_BUDGET                   0                       // MB for port buffers and rings, 0 uses the counts above
+#define MAIN_THREAD_POLICY              SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define MAIN_THREAD_PRIORITY            0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define MAIN_THREAD_CPU                 -1                      // -1 doesn't pin the thread
+#define WRITER_THREAD_POLICY            SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define WRITER_THREAD_PRIORITY          0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define WRITER_THREAD_CPU               -1                      // -1 doesn't pin the thread
+#define CALLBACK_THREAD_POLICY          SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define CALLBACK_THREAD_PRIORITY        0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define CALLBACK_THREAD_CPU             -1                      // -1 doesn't pin the thread
+#define LOCKED_FRAME_MEMORY             0                       // 1 maps frame memory from huge pages and locks it
+#define HUGE_PAGE_SIZE                  (2 * 1024 * 1024)
+#define JITTER_LOG_THRESHOLD            5                       // ms
+#define CONCURRENT_BRINGUP              1                       // 0 waits for each startup command in turn
+#define OMX_COMMAND_TIMEOUT             2000                    // ms
+#define TEARDOWN_TIMEOUT                1000                    // ms, for the whole teardown
 
 // Dunno where this is originally stolen from...
 #define OMX_INIT_STRUCTURE(a) \
@@ -78,53 +137,1333 @@
 // Global variable used by the signal handler and capture loop
 static int want_quit = 0;
 
+// OMX_EventCmdComplete event received by the event handler
+// but not yet waited for by the main routine
+#define MAX_COMMAND_EVENTS 32
+typedef struct {
+    OMX_HANDLETYPE hComponent;
+    OMX_U32 nCommand;
+    OMX_U32 nData2;
+} omx_command_event;
+
+// Commands sent to the components but not yet waited for
+#define MAX_PENDING_COMMANDS 32
+
+// Single producer, single consumer ring of buffer headers passed from an OMX
+// callback to the main loop without locking. Only the producer writes head
+// and only the consumer writes tail. It must have room for all the buffers
+// of the port so that pushing never fails.
+#define BUFFER_RING_SIZE 32 // power of two
+typedef struct {
+    OMX_BUFFERHEADERTYPE *buffers[BUFFER_RING_SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+} buffer_ring;
+
+// Pool of preallocated output frames shared by the main loop and the consumers
+// of the frames. Each consumer holds a reference to the frame, and the frame
+// is recycled once the last reference has been dropped. Only the padding that
+// unpacking the camera buffers doesn't overwrite is cleared then.
+typedef struct {
+    unsigned char *memory;
+    size_t mapped_size;
+    unsigned char **free_frames;
+    volatile int *refs;
+    int pool_size;
+    int free_count;
+    size_t frame_size;
+    size_t padding_offset[3];
+    size_t padding_size[3];
+    int padding_count;
+    pthread_mutex_t lock;
+    // Statistics
+    int frames_allocated;
+    int frames_acquired;
+    int frames_dropped;
+    unsigned long long bytes_cleared;
+} frame_pool;
+
+// Queue of unpacked frames written out by the writer thread. The main loop
+// queues a frame, the writer thread writes it out and drops its reference.
+typedef struct {
+    frame_pool *pool;
+    unsigned char **full_frames;
+    int full_first;
+    int full_count;
+    int done;
+    FILE *fd;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t frame_available;
+    // Statistics
+    int frames_written;
+    int full_count_max;
+    unsigned long long write_stall_max_ns;
+} frame_writer;
+
+// Metadata of a buffer, preallocated in one slab for all the buffers of a
+// port and attached to the buffer header with pAppPrivate
+typedef struct {
+    int buffer_index;
+    unsigned int sequence;          // times the component has returned the buffer
+    OMX_TICKS timestamp;            // nTimeStamp when last returned
+    OMX_U32 flags;                  // nFlags when last returned
+    unsigned long long enqueue_ns;  // when last handed to the component
+    unsigned long long dequeue_ns;  // when last returned by the component
+    int frame_index;
+    int slice_index;
+} buffer_meta;
+
+#define BUFFER_META(buffer) ((buffer_meta*)(buffer)->pAppPrivate)
+
+// A pool of port buffers or ring slots sized by plan_buffers(). Port
+// buffer pools have the component and the port set.
+typedef struct {
+    const char *name;
+    OMX_HANDLETYPE component;
+    OMX_U32 port;
+    size_t size;        // bytes per buffer
+    int count_min;
+    int count_max;
+    int count;
+} buffer_plan;
+
+// Regular output file the frames are unpacked to in place. The file is
+// preallocated and mapped OUTPUT_MAP_FRAMES frames at a time.
+typedef struct {
+    int fd;
+    size_t frame_size;
+    off_t base_offset;
+    unsigned char *map;
+    size_t map_len;
+    off_t map_offset;
+    int map_first_frame;
+    int map_frames;
+    // Statistics
+    int frames_written;
+    int maps;
+    unsigned long long remap_max_ns;
+} output_map;
+
 // Our application context passed around
 // the main routine and callback handlers
 typedef struct {
     OMX_HANDLETYPE camera;
     OMX_BUFFERHEADERTYPE *camera_ppBuffer_in;
-    OMX_BUFFERHEADERTYPE *camera_ppBuffer_out;
+    OMX_BUFFERHEADERTYPE **camera_ppBuffer_out;
+    buffer_meta *camera_output_buffer_meta;
+    int camera_output_buffer_count;
     int camera_ready;
-    int camera_output_buffer_available;
+    buffer_ring camera_output_buffers_filled;
+    VCOS_SEMAPHORE_T camera_output_buffer_ready;
     OMX_HANDLETYPE null_sink;
-    int flushed;
     FILE *fd_out;
-    VCOS_SEMAPHORE_T handler_lock;
+    // Set when the frames are unpacked straight to the output file
+    int scatter_output;
+    output_map output;
+    int frame_pool_size;
+    frame_pool frames;
+    frame_writer writer;
+    // Reduced copy of the frames, see DOWNSCALE_FACTOR
+    FILE *fd_reduced;
+    int reduced_pool_size;
+    frame_pool reduced_frames;
+    frame_writer reduced_writer;
+    omx_command_event command_events[MAX_COMMAND_EVENTS];
+    int command_events_count;
+    omx_command_event pending_commands[MAX_PENDING_COMMANDS];
+    int pending_commands_count;
+    pthread_mutex_t command_lock;
+    pthread_cond_t command_cond;
 } appctx;
 
-// I420 frame stuff
+// Frame to frame jitter as seen by the main loop, i.e. how much the interval
+// between two frames differs from the interval between the previous two
+typedef struct {
+    unsigned int frames;
+    unsigned long long last_ns;
+    unsigned long long last_interval_ns;
+    unsigned int samples;
+    unsigned int over_threshold;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+} jitter_stats;
+
+// Formats the I420 slices of the camera can be converted to while unpacking
+typedef enum {
+    OUTPUT_FORMAT_I420,
+    OUTPUT_FORMAT_NV12,
+    OUTPUT_FORMAT_YUY2,
+    OUTPUT_FORMAT_RGB24,
+    OUTPUT_FORMAT_BGRA,
+    OUTPUT_FORMAT_Y,     // Y plane only
+    OUTPUT_FORMAT_UV,    // interleaved U and V plane of NV12 only
+} output_format;
+static const char *output_format_names[] = { "I420", "NV12", "YUY2", "RGB24", "BGRA", "Y", "UV" };
+
+// Filters of the reduced copy
+typedef enum {
+    DOWNSCALE_BOX,
+    DOWNSCALE_BILINEAR,
+} downscale_filter;
+static const char *downscale_filter_names[] = { "box", "bilinear" };
+
+// I420 frame stuff, also describes the frames of the other output formats
 typedef struct {
+    output_format format;
     int width;
     int height;
     size_t size;
     int buf_stride;
     int buf_slice_height;
     int buf_extra_padding;
+    int planes;
     int p_offset[3];
     int p_stride[3];
+    int p_width[3];  // bytes of image data in a row
+    int p_height[3];
+    int rotation;    // degrees clockwise, see OUTPUT_ROTATION
 } i420_frame_info;
 
-// Stolen from video-info.c of gstreamer-plugins-base
+// Adapted from video-info.c of gstreamer-plugins-base. The strides are
+// rounded up to a multiple of align bytes. With align 1 the planes are packed
+// tightly, otherwise the Y plane gets an even number of rows like in
+// GStreamer. The layout is a constant expression of constant arguments, so
+// that the layouts of fixed frame sizes can be worked out at compile time.
 #define ROUND_UP_2(num) (((num)+1)&~1)
-#define ROUND_UP_4(num) (((num)+3)&~3)
-static void get_i420_frame_info(int width, int height, int buf_stride, int buf_slice_height, i420_frame_info *info) {
-    info->p_stride[0] = ROUND_UP_4(width);
-    info->p_stride[1] = ROUND_UP_4(ROUND_UP_2(width) / 2);
-    info->p_stride[2] = info->p_stride[1];
-    info->p_offset[0] = 0;
-    info->p_offset[1] = info->p_stride[0] * ROUND_UP_2(height);
-    info->p_offset[2] = info->p_offset[1] + info->p_stride[1] * (ROUND_UP_2(height) / 2);
-    info->size = info->p_offset[2] + info->p_stride[2] * (ROUND_UP_2(height) / 2);
-    info->width = width;
-    info->height = height;
-    info->buf_stride = buf_stride;
-    info->buf_slice_height = buf_slice_height;
-    info->buf_extra_padding =
-        buf_slice_height >= 0
-        ? ((buf_slice_height && (height % buf_slice_height))
-             ? (buf_slice_height - (height % buf_slice_height))
-             : 0)
-        : -1;
+#define ROUND_UP_N(num, n) (((num) + (n) - 1) / (n) * (n))
+#define I420_Y_STRIDE(width, align)     ROUND_UP_N(width, align)
+#define I420_UV_STRIDE(width, align)    ROUND_UP_N(((width) + 1) / 2, align)
+#define I420_Y_HEIGHT(height, align)    ((align) > 1 ? ROUND_UP_2(height) : (height))
+#define I420_UV_HEIGHT(height)          (((height) + 1) / 2)
+#define I420_U_OFFSET(width, height, align) \
+    (I420_Y_STRIDE(width, align) * I420_Y_HEIGHT(height, align))
+#define I420_V_OFFSET(width, height, align) \
+    (I420_U_OFFSET(width, height, align) + I420_UV_STRIDE(width, align) * I420_UV_HEIGHT(height))
+#define I420_SIZE(width, height, align) \
+    (I420_V_OFFSET(width, height, align) + I420_UV_STRIDE(width, align) * I420_UV_HEIGHT(height))
+#define I420_EXTRA_PADDING(height, buf_slice_height) \
+    ((buf_slice_height) >= 0 \
+        ? (((buf_slice_height) && ((height) % (buf_slice_height))) \
+             ? ((buf_slice_height) - ((height) % (buf_slice_height))) \
+             : 0) \
+        : -1)
+#define I420_FRAME_INFO(w, h, align, stride, slice_height) { \
+    .format = OUTPUT_FORMAT_I420, \
+    .width = (w), \
+    .height = (h), \
+    .size = I420_SIZE(w, h, align), \
+    .buf_stride = (stride), \
+    .buf_slice_height = (slice_height), \
+    .buf_extra_padding = I420_EXTRA_PADDING(h, slice_height), \
+    .planes = 3, \
+    .p_offset = { 0, I420_U_OFFSET(w, h, align), I420_V_OFFSET(w, h, align) }, \
+    .p_stride = { I420_Y_STRIDE(w, align), I420_UV_STRIDE(w, align), I420_UV_STRIDE(w, align) }, \
+    .p_width  = { (w), ((w) + 1) / 2, ((w) + 1) / 2 }, \
+    .p_height = { I420_Y_HEIGHT(h, align), I420_UV_HEIGHT(h), I420_UV_HEIGHT(h) }, \
+    .rotation = 0, \
+}
+static void get_i420_frame_info(int width, int height, int align, int buf_stride, int buf_slice_height, i420_frame_info *info) {
+    i420_frame_info layout = I420_FRAME_INFO(width, height, align, buf_stride, buf_slice_height);
+    *info = layout;
+}
+
+// Layout of a frame converted to another output format. NV12 has the Y plane
+// and one plane of interleaved U and V, YUY2, RGB24 and BGRA have a single
+// plane of packed pixels. Y and UV have just one of the planes of NV12.
+static void get_output_frame_info(output_format format, int width, int height, int align, int buf_stride, int buf_slice_height, i420_frame_info *info) {
+    int i;
+    get_i420_frame_info(width, height, align, buf_stride, buf_slice_height, info);
+    if(format == OUTPUT_FORMAT_I420) {
+        return;
+    }
+    info->format = format;
+    memset(info->p_width, 0, sizeof(info->p_width));
+    memset(info->p_height, 0, sizeof(info->p_height));
+    switch(format) {
+        case OUTPUT_FORMAT_NV12:
+            info->planes = 2;
+            info->p_width[0] = width;
+            info->p_width[1] = (width + 1) / 2 * 2;
+            info->p_height[0] = height;
+            info->p_height[1] = (height + 1) / 2;
+            break;
+        case OUTPUT_FORMAT_Y:
+            info->planes = 1;
+            info->p_width[0] = width;
+            info->p_height[0] = height;
+            break;
+        case OUTPUT_FORMAT_UV:
+            info->planes = 1;
+            info->p_width[0] = (width + 1) / 2 * 2;
+            info->p_height[0] = (height + 1) / 2;
+            break;
+        default:
+            info->planes = 1;
+            info->p_width[0] =
+                format == OUTPUT_FORMAT_YUY2  ? (width + 1) / 2 * 4 :
+                format == OUTPUT_FORMAT_RGB24 ? width * 3 :
+                width * 4;
+            info->p_height[0] = height;
+            break;
+    }
+    info->size = 0;
+    for(i = 0; i < 3; i++) {
+        info->p_stride[i] = ROUND_UP_N(info->p_width[i], align);
+        info->p_offset[i] = i < info->planes ? info->size : 0;
+        info->size += info->p_stride[i] * info->p_height[i];
+    }
+}
+
+// Layout of the frame rotated by 90, 180 or 270 degrees. The width and the
+// height of the frame are swapped with 90 and 270 degrees, the slices of the
+// buffer stay the same.
+static void rotate_frame_info(i420_frame_info *info, int rotation, int align) {
+    int buf_extra_padding = info->buf_extra_padding;
+    if(rotation == 90 || rotation == 270) {
+        get_output_frame_info(info->format, info->height, info->width, align, info->buf_stride, info->buf_slice_height, info);
+        info->buf_extra_padding = buf_extra_padding;
+    }
+    info->rotation = rotation;
+}
+
+// A chroma plane has half as many rows as the Y plane
+static int is_chroma_plane(const i420_frame_info *info, int plane) {
+    return plane > 0 || info->format == OUTPUT_FORMAT_UV;
+}
+
+// Regions of the frame that unpacking the buffers doesn't overwrite, that is
+// the last row of the Y plane of an aligned I420 layout when the height of
+// the frame is odd. Returns the number of regions.
+static int get_i420_padding(const i420_frame_info *info, size_t offset[3], size_t size[3]) {
+    int rows_written, i, count = 0;
+    for(i = 0; i < info->planes; i++) {
+        rows_written = (is_chroma_plane(info, i) ? (info->height + 1) / 2 : info->height);
+        if(info->p_height[i] > rows_written) {
+            offset[count] = info->p_offset[i] + info->p_stride[i] * rows_written;
+            size[count] = info->p_stride[i] * (info->p_height[i] - rows_written);
+            count++;
+        }
+    }
+    return count;
+}
+
+// Bytes of the frame that unpacking the buffers writes
+static size_t get_i420_unpacked_size(const i420_frame_info *info) {
+    size_t offset[3], size[3], unpacked_size = info->size;
+    int i, count = get_i420_padding(info, offset, size);
+    for(i = 0; i < count; i++) {
+        unpacked_size -= size[i];
+    }
+    return unpacked_size;
+}
+
+// Unpack kernels copy rows of a plane span from a buffer to a frame. The rows
+// of the buffer can be longer than the rows of the frame, the extra stride is
+// dropped. They also convert rows of I420 to the other output formats. The
+// best kernel supported by the CPU is picked at runtime.
+typedef void (*unpack_rows_fn)(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows);
+// Interleaves width U and V samples to NV12
+typedef void (*interleave_uv_fn)(unsigned char *dst, const unsigned char *u, const unsigned char *v, int width);
+// Converts a row of width pixels, u and v are the chroma row of the pixels
+typedef void (*convert_row_fn)(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width);
+// Downscales factor x factor blocks of a plane span to a row of width
+// pixels. The blocks at the right and the bottom edge of the plane are
+// clamped to src_width columns and src_rows rows.
+typedef void (*downscale_row_fn)(unsigned char *dst, int width, const unsigned char *src, int src_stride, int src_width, int src_rows, int factor);
+// Transposes a block of width x rows pixels, column x of src becomes row x
+// of dst. A negative stride walks the rows backwards, which mirrors the block.
+typedef void (*transpose_fn)(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows);
+// Copies a row of width pixels in reverse order
+typedef void (*reverse_row_fn)(unsigned char *dst, const unsigned char *src, int width);
+
+// Reference kernel
+static void unpack_rows_scalar(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows) {
+    for(; rows > 0; rows--) {
+        memcpy(dst, src, width);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+static void interleave_uv_scalar(unsigned char *dst, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x < width; x++) {
+        dst[2 * x]     = u[x];
+        dst[2 * x + 1] = v[x];
+    }
+}
+
+// The last pixel of an odd width row is doubled
+static void pack_yuy2_scalar(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x < width; x += 2) {
+        dst[2 * x]     = y[x];
+        dst[2 * x + 1] = u[x / 2];
+        dst[2 * x + 2] = y[x + 1 < width ? x + 1 : x];
+        dst[2 * x + 3] = v[x / 2];
+    }
+}
+
+// BT.601 limited range YUV to RGB in 6 bit fixed point. The SIMD kernels
+// compute the same with saturating 16 bit arithmetic, which only saturates
+// when the result is clipped anyway, so all the kernels agree bit by bit.
+#define YUV_TO_RGB_SHIFT 6
+#define YUV_TO_RGB_Y     74  // 1.164
+#define YUV_TO_RGB_RV    102 // 1.596
+#define YUV_TO_RGB_GU    25  // 0.391
+#define YUV_TO_RGB_GV    52  // 0.813
+#define YUV_TO_RGB_BU    129 // 2.018
+static inline unsigned char clip_u8(int value) {
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline void yuv_to_rgb_pixel(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b) {
+    int c = YUV_TO_RGB_Y * (y - 16), d = u - 128, e = v - 128, round = 1 << (YUV_TO_RGB_SHIFT - 1);
+    *r = clip_u8((c + YUV_TO_RGB_RV * e + round) >> YUV_TO_RGB_SHIFT);
+    *g = clip_u8((c - YUV_TO_RGB_GU * d - YUV_TO_RGB_GV * e + round) >> YUV_TO_RGB_SHIFT);
+    *b = clip_u8((c + YUV_TO_RGB_BU * d + round) >> YUV_TO_RGB_SHIFT);
+}
+
+static void yuv_to_rgb24_scalar(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x < width; x++) {
+        yuv_to_rgb_pixel(y[x], u[x / 2], v[x / 2], &dst[3 * x], &dst[3 * x + 1], &dst[3 * x + 2]);
+    }
+}
+
+static void yuv_to_bgra_scalar(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x < width; x++) {
+        yuv_to_rgb_pixel(y[x], u[x / 2], v[x / 2], &dst[4 * x + 2], &dst[4 * x + 1], &dst[4 * x]);
+        dst[4 * x + 3] = 255;
+    }
+}
+
+// Averages taps x taps pixels starting at row and column first of each block
+static void downscale_block_scalar(unsigned char *dst, int width, const unsigned char *src, int src_stride, int src_width, int src_rows,
+        int factor, int first, int taps) {
+    int x, r, c, row, col, sum;
+    for(x = 0; x < width; x++) {
+        sum = 0;
+        for(r = first; r < first + taps; r++) {
+            row = r < src_rows ? r : src_rows - 1;
+            for(c = first; c < first + taps; c++) {
+                col = x * factor + c < src_width ? x * factor + c : src_width - 1;
+                sum += src[row * src_stride + col];
+            }
+        }
+        dst[x] = (sum + taps * taps / 2) / (taps * taps);
+    }
+}
+
+// The box filter averages the whole block
+static void downscale_box_scalar(unsigned char *dst, int width, const unsigned char *src, int src_stride, int src_width, int src_rows, int factor) {
+    downscale_block_scalar(dst, width, src, src_stride, src_width, src_rows, factor, 0, factor);
+}
+
+// The bilinear filter samples the block at its centre, that is it averages
+// the two middle rows and columns of the block
+static void downscale_bilinear_scalar(unsigned char *dst, int width, const unsigned char *src, int src_stride, int src_width, int src_rows, int factor) {
+    downscale_block_scalar(dst, width, src, src_stride, src_width, src_rows, factor, factor / 2 - 1, 2);
+}
+
+static void transpose_scalar(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows) {
+    int x, y;
+    for(x = 0; x < width; x++) {
+        for(y = 0; y < rows; y++) {
+            dst[y] = src[y * src_stride + x];
+        }
+        dst += dst_stride;
+    }
+}
+
+static void reverse_row_scalar(unsigned char *dst, const unsigned char *src, int width) {
+    int x;
+    for(x = 0; x < width; x++) {
+        dst[x] = src[width - 1 - x];
+    }
+}
+
+#ifdef HAVE_NEON_KERNELS
+NEON_KERNELS_BEGIN
+static void unpack_rows_neon(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows) {
+    int x;
+    for(; rows > 0; rows--) {
+        for(x = 0; x + 64 <= width; x += 64) {
+            uint8x16_t a = vld1q_u8(src + x), b = vld1q_u8(src + x + 16);
+            uint8x16_t c = vld1q_u8(src + x + 32), d = vld1q_u8(src + x + 48);
+            vst1q_u8(dst + x, a);
+            vst1q_u8(dst + x + 16, b);
+            vst1q_u8(dst + x + 32, c);
+            vst1q_u8(dst + x + 48, d);
+        }
+        for(; x + 16 <= width; x += 16) {
+            vst1q_u8(dst + x, vld1q_u8(src + x));
+        }
+        memcpy(dst + x, src + x, width - x);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+static void interleave_uv_neon(unsigned char *dst, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        uint8x16x2_t uv = { { vld1q_u8(u + x), vld1q_u8(v + x) } };
+        vst2q_u8(dst + 2 * x, uv);
+    }
+    interleave_uv_scalar(dst + 2 * x, u + x, v + x, width - x);
+}
+
+static void pack_yuy2_neon(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        uint8x8x2_t yy = vld2_u8(y + x);
+        uint8x8x4_t yuyv = { { yy.val[0], vld1_u8(u + x / 2), yy.val[1], vld1_u8(v + x / 2) } };
+        vst4_u8(dst + 2 * x, yuyv);
+    }
+    pack_yuy2_scalar(dst + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+// Converts 16 pixels
+static inline void yuv_to_rgb_neon(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+        uint8x16_t *r, uint8x16_t *g, uint8x16_t *b) {
+    uint8x16_t yy = vld1q_u8(y);
+    uint8x8x2_t uu = vzip_u8(vld1_u8(u), vld1_u8(u));
+    uint8x8x2_t vv = vzip_u8(vld1_u8(v), vld1_u8(v));
+    int16x8_t c, d, e, rr[2], gg[2], bb[2];
+    int i;
+    for(i = 0; i < 2; i++) {
+        c = vmulq_n_s16(vreinterpretq_s16_u16(vsubl_u8(i ? vget_high_u8(yy) : vget_low_u8(yy), vdup_n_u8(16))), YUV_TO_RGB_Y);
+        d = vreinterpretq_s16_u16(vsubl_u8(uu.val[i], vdup_n_u8(128)));
+        e = vreinterpretq_s16_u16(vsubl_u8(vv.val[i], vdup_n_u8(128)));
+        rr[i] = vqaddq_s16(c, vmulq_n_s16(e, YUV_TO_RGB_RV));
+        gg[i] = vqsubq_s16(vqsubq_s16(c, vmulq_n_s16(d, YUV_TO_RGB_GU)), vmulq_n_s16(e, YUV_TO_RGB_GV));
+        bb[i] = vqaddq_s16(c, vmulq_n_s16(d, YUV_TO_RGB_BU));
+    }
+    *r = vcombine_u8(vqrshrun_n_s16(rr[0], YUV_TO_RGB_SHIFT), vqrshrun_n_s16(rr[1], YUV_TO_RGB_SHIFT));
+    *g = vcombine_u8(vqrshrun_n_s16(gg[0], YUV_TO_RGB_SHIFT), vqrshrun_n_s16(gg[1], YUV_TO_RGB_SHIFT));
+    *b = vcombine_u8(vqrshrun_n_s16(bb[0], YUV_TO_RGB_SHIFT), vqrshrun_n_s16(bb[1], YUV_TO_RGB_SHIFT));
+}
+
+static void yuv_to_rgb24_neon(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        uint8x16x3_t rgb;
+        yuv_to_rgb_neon(y + x, u + x / 2, v + x / 2, &rgb.val[0], &rgb.val[1], &rgb.val[2]);
+        vst3q_u8(dst + 3 * x, rgb);
+    }
+    yuv_to_rgb24_scalar(dst + 3 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+static void yuv_to_bgra_neon(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        uint8x16x4_t bgra;
+        yuv_to_rgb_neon(y + x, u + x / 2, v + x / 2, &bgra.val[2], &bgra.val[1], &bgra.val[0]);
+        bgra.val[3] = vdupq_n_u8(255);
+        vst4q_u8(dst + 4 * x, bgra);
+    }
+    yuv_to_bgra_scalar(dst + 4 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+static void downscale_box_neon(unsigned char *dst, int width, const unsigned char *src, int src_stride, int src_width, int src_rows, int factor) {
+    unsigned char out[8];
+    uint16x8_t sum;
+    uint8x8_t avg;
+    int x = 0, r, n = 16 / factor;
+    for(; src_rows >= factor && x + n <= width && (x + n) * factor <= src_width; x += n) {
+        // Sums of column pairs over the rows, then pairs of pairs
+        sum = vpaddlq_u8(vld1q_u8(src + x * factor));
+        for(r = 1; r < factor; r++) {
+            sum = vpadalq_u8(sum, vld1q_u8(src + r * src_stride + x * factor));
+        }
+        if(factor == 2) {
+            avg = vrshrn_n_u16(sum, 2);
+        } else if(factor == 4) {
+            uint16x4_t avg4 = vrshrn_n_u32(vpaddlq_u16(sum), 4);
+            avg = vmovn_u16(vcombine_u16(avg4, avg4));
+        } else {
+            uint32x2_t avg2 = vrshrn_n_u64(vpaddlq_u32(vpaddlq_u16(sum)), 6);
+            uint16x4_t avg4 = vmovn_u32(vcombine_u32(avg2, avg2));
+            avg = vmovn_u16(vcombine_u16(avg4, avg4));
+        }
+        vst1_u8(out, avg);
+        memcpy(dst + x, out, n);
+    }
+    downscale_box_scalar(dst + x, width - x, src + x * factor, src_stride, src_width - x * factor, src_rows, factor);
+}
+
+// The middle columns of the blocks are deinterleaved while loading
+static void downscale_bilinear_neon(unsigned char *dst, int width, const unsigned char *src, int src_stride, int src_width, int src_rows, int factor) {
+    const unsigned char *row0 = src + (factor / 2 - 1) * src_stride, *row1 = row0 + src_stride;
+    uint16x8_t sum;
+    int x = 0;
+    if(factor == 2) {
+        downscale_box_neon(dst, width, src, src_stride, src_width, src_rows, factor);
+        return;
+    }
+    for(; src_rows >= factor && x + 8 <= width && (x + 8) * factor <= src_width; x += 8) {
+        if(factor == 4) {
+            uint8x8x4_t a = vld4_u8(row0 + x * 4), b = vld4_u8(row1 + x * 4);
+            sum = vaddq_u16(vaddl_u8(a.val[1], a.val[2]), vaddl_u8(b.val[1], b.val[2]));
+        } else {
+            // Column 3 of block i is a.val[3][2i], column 4 is a.val[0][2i + 1]
+            uint8x16x4_t a = vld4q_u8(row0 + x * 8), b = vld4q_u8(row1 + x * 8);
+            uint8x16x2_t a34 = vuzpq_u8(a.val[3], a.val[0]), b34 = vuzpq_u8(b.val[3], b.val[0]);
+            sum = vaddq_u16(vaddl_u8(vget_low_u8(a34.val[0]), vget_high_u8(a34.val[1])),
+                            vaddl_u8(vget_low_u8(b34.val[0]), vget_high_u8(b34.val[1])));
+        }
+        vst1_u8(dst + x, vrshrn_n_u16(sum, 2));
+    }
+    downscale_bilinear_scalar(dst + x, width - x, src + x * factor, src_stride, src_width - x * factor, src_rows, factor);
+}
+
+// Three rounds of trading the odd and even lanes of row pairs
+static inline void transpose_8x8_neon(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride) {
+    uint8x8x2_t r01 = vtrn_u8(vld1_u8(src),                  vld1_u8(src + src_stride));
+    uint8x8x2_t r23 = vtrn_u8(vld1_u8(src + 2 * src_stride), vld1_u8(src + 3 * src_stride));
+    uint8x8x2_t r45 = vtrn_u8(vld1_u8(src + 4 * src_stride), vld1_u8(src + 5 * src_stride));
+    uint8x8x2_t r67 = vtrn_u8(vld1_u8(src + 6 * src_stride), vld1_u8(src + 7 * src_stride));
+    uint16x4x2_t c02 = vtrn_u16(vreinterpret_u16_u8(r01.val[0]), vreinterpret_u16_u8(r23.val[0]));
+    uint16x4x2_t c13 = vtrn_u16(vreinterpret_u16_u8(r01.val[1]), vreinterpret_u16_u8(r23.val[1]));
+    uint16x4x2_t c46 = vtrn_u16(vreinterpret_u16_u8(r45.val[0]), vreinterpret_u16_u8(r67.val[0]));
+    uint16x4x2_t c57 = vtrn_u16(vreinterpret_u16_u8(r45.val[1]), vreinterpret_u16_u8(r67.val[1]));
+    uint32x2x2_t c04 = vtrn_u32(vreinterpret_u32_u16(c02.val[0]), vreinterpret_u32_u16(c46.val[0]));
+    uint32x2x2_t c15 = vtrn_u32(vreinterpret_u32_u16(c13.val[0]), vreinterpret_u32_u16(c57.val[0]));
+    uint32x2x2_t c26 = vtrn_u32(vreinterpret_u32_u16(c02.val[1]), vreinterpret_u32_u16(c46.val[1]));
+    uint32x2x2_t c37 = vtrn_u32(vreinterpret_u32_u16(c13.val[1]), vreinterpret_u32_u16(c57.val[1]));
+    vst1_u8(dst,                  vreinterpret_u8_u32(c04.val[0]));
+    vst1_u8(dst + dst_stride,     vreinterpret_u8_u32(c15.val[0]));
+    vst1_u8(dst + 2 * dst_stride, vreinterpret_u8_u32(c26.val[0]));
+    vst1_u8(dst + 3 * dst_stride, vreinterpret_u8_u32(c37.val[0]));
+    vst1_u8(dst + 4 * dst_stride, vreinterpret_u8_u32(c04.val[1]));
+    vst1_u8(dst + 5 * dst_stride, vreinterpret_u8_u32(c15.val[1]));
+    vst1_u8(dst + 6 * dst_stride, vreinterpret_u8_u32(c26.val[1]));
+    vst1_u8(dst + 7 * dst_stride, vreinterpret_u8_u32(c37.val[1]));
+}
+
+// Column strips of 8x8 tiles, so that each row of dst is written 8 bytes at
+// a time, the edges that don't fill a tile are done by the scalar kernel
+static void transpose_neon(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows) {
+    int x, y;
+    for(x = 0; x + 8 <= width; x += 8) {
+        for(y = 0; y + 8 <= rows; y += 8) {
+            transpose_8x8_neon(dst + x * dst_stride + y, dst_stride, src + y * src_stride + x, src_stride);
+        }
+        transpose_scalar(dst + x * dst_stride + y, dst_stride, src + y * src_stride + x, src_stride, 8, rows - y);
+    }
+    transpose_scalar(dst + x * dst_stride, dst_stride, src + x, src_stride, width - x, rows);
+}
+
+static void reverse_row_neon(unsigned char *dst, const unsigned char *src, int width) {
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        uint8x16_t a = vrev64q_u8(vld1q_u8(src + width - 16 - x));
+        vst1q_u8(dst + x, vcombine_u8(vget_high_u8(a), vget_low_u8(a)));
+    }
+    reverse_row_scalar(dst + x, src, width - x);
+}
+NEON_KERNELS_END
+
+static int cpu_has_neon(void) {
+#if defined(__aarch64__)
+    return 1;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_ARM_NEON) != 0;
+#endif
+}
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static void unpack_rows_sse2(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows) {
+    int x;
+    for(; rows > 0; rows--) {
+        for(x = 0; x + 64 <= width; x += 64) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + x));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + x + 16));
+            __m128i c = _mm_loadu_si128((const __m128i*)(src + x + 32));
+            __m128i d = _mm_loadu_si128((const __m128i*)(src + x + 48));
+            _mm_storeu_si128((__m128i*)(dst + x), a);
+            _mm_storeu_si128((__m128i*)(dst + x + 16), b);
+            _mm_storeu_si128((__m128i*)(dst + x + 32), c);
+            _mm_storeu_si128((__m128i*)(dst + x + 48), d);
+        }
+        for(; x + 16 <= width; x += 16) {
+            _mm_storeu_si128((__m128i*)(dst + x), _mm_loadu_si128((const __m128i*)(src + x)));
+        }
+        memcpy(dst + x, src + x, width - x);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+__attribute__((target("sse2")))
+static void interleave_uv_sse2(unsigned char *dst, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        __m128i uu = _mm_loadu_si128((const __m128i*)(u + x));
+        __m128i vv = _mm_loadu_si128((const __m128i*)(v + x));
+        _mm_storeu_si128((__m128i*)(dst + 2 * x), _mm_unpacklo_epi8(uu, vv));
+        _mm_storeu_si128((__m128i*)(dst + 2 * x + 16), _mm_unpackhi_epi8(uu, vv));
+    }
+    interleave_uv_scalar(dst + 2 * x, u + x, v + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void pack_yuy2_sse2(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        __m128i yy = _mm_loadu_si128((const __m128i*)(y + x));
+        __m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(u + x / 2)), _mm_loadl_epi64((const __m128i*)(v + x / 2)));
+        _mm_storeu_si128((__m128i*)(dst + 2 * x), _mm_unpacklo_epi8(yy, uv));
+        _mm_storeu_si128((__m128i*)(dst + 2 * x + 16), _mm_unpackhi_epi8(yy, uv));
+    }
+    pack_yuy2_scalar(dst + 2 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+// Converts 16 pixels
+__attribute__((target("sse2")))
+static inline void yuv_to_rgb_sse2(const unsigned char *y, const unsigned char *u, const unsigned char *v,
+        __m128i *r, __m128i *g, __m128i *b) {
+    __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(1 << (YUV_TO_RGB_SHIFT - 1));
+    __m128i yy = _mm_loadu_si128((const __m128i*)y);
+    __m128i uu = _mm_loadl_epi64((const __m128i*)u);
+    __m128i vv = _mm_loadl_epi64((const __m128i*)v);
+    __m128i c, d, e, rr[2], gg[2], bb[2];
+    int i;
+    uu = _mm_unpacklo_epi8(uu, uu);
+    vv = _mm_unpacklo_epi8(vv, vv);
+    for(i = 0; i < 2; i++) {
+        c = i ? _mm_unpackhi_epi8(yy, zero) : _mm_unpacklo_epi8(yy, zero);
+        d = i ? _mm_unpackhi_epi8(uu, zero) : _mm_unpacklo_epi8(uu, zero);
+        e = i ? _mm_unpackhi_epi8(vv, zero) : _mm_unpacklo_epi8(vv, zero);
+        c = _mm_mullo_epi16(_mm_sub_epi16(c, _mm_set1_epi16(16)), _mm_set1_epi16(YUV_TO_RGB_Y));
+        d = _mm_sub_epi16(d, _mm_set1_epi16(128));
+        e = _mm_sub_epi16(e, _mm_set1_epi16(128));
+        rr[i] = _mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(YUV_TO_RGB_RV)));
+        gg[i] = _mm_subs_epi16(_mm_subs_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(YUV_TO_RGB_GU))),
+            _mm_mullo_epi16(e, _mm_set1_epi16(YUV_TO_RGB_GV)));
+        bb[i] = _mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(YUV_TO_RGB_BU)));
+        rr[i] = _mm_srai_epi16(_mm_adds_epi16(rr[i], round), YUV_TO_RGB_SHIFT);
+        gg[i] = _mm_srai_epi16(_mm_adds_epi16(gg[i], round), YUV_TO_RGB_SHIFT);
+        bb[i] = _mm_srai_epi16(_mm_adds_epi16(bb[i], round), YUV_TO_RGB_SHIFT);
+    }
+    *r = _mm_packus_epi16(rr[0], rr[1]);
+    *g = _mm_packus_epi16(gg[0], gg[1]);
+    *b = _mm_packus_epi16(bb[0], bb[1]);
+}
+
+// SSE2 has no byte shuffle, the 3 byte pixels are packed from registers
+// spilled to the stack
+__attribute__((target("sse2")))
+static void yuv_to_rgb24_sse2(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    unsigned char rgb[3][16] __attribute__((aligned(16)));
+    __m128i r, g, b;
+    int x, i;
+    for(x = 0; x + 16 <= width; x += 16) {
+        yuv_to_rgb_sse2(y + x, u + x / 2, v + x / 2, &r, &g, &b);
+        _mm_store_si128((__m128i*)rgb[0], r);
+        _mm_store_si128((__m128i*)rgb[1], g);
+        _mm_store_si128((__m128i*)rgb[2], b);
+        for(i = 0; i < 16; i++) {
+            dst[3 * (x + i)]     = rgb[0][i];
+            dst[3 * (x + i) + 1] = rgb[1][i];
+            dst[3 * (x + i) + 2] = rgb[2][i];
+        }
+    }
+    yuv_to_rgb24_scalar(dst + 3 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+__attribute__((target("sse2")))
+static void yuv_to_bgra_sse2(unsigned char *dst, const unsigned char *y, const unsigned char *u, const unsigned char *v, int width) {
+    __m128i r, g, b, bg, ra, alpha = _mm_set1_epi8((char)255);
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        yuv_to_rgb_sse2(y + x, u + x / 2, v + x / 2, &r, &g, &b);
+        bg = _mm_unpacklo_epi8(b, g);
+        ra = _mm_unpacklo_epi8(r, alpha);
+        _mm_storeu_si128((__m128i*)(dst + 4 * x), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i*)(dst + 4 * x + 16), _mm_unpackhi_epi16(bg, ra));
+        bg = _mm_unpackhi_epi8(b, g);
+        ra = _mm_unpackhi_epi8(r, alpha);
+        _mm_storeu_si128((__m128i*)(dst + 4 * x + 32), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i*)(dst + 4 * x + 48), _mm_unpackhi_epi16(bg, ra));
+    }
+    yuv_to_bgra_scalar(dst + 4 * x, y + x, u + x / 2, v + x / 2, width - x);
+}
+
+// Stores the n averages in the low bytes of the 16 or 32 bit lanes of avg
+__attribute__((target("sse2")))
+static inline void store_averages_sse2(unsigned char *dst, __m128i avg, int n, int lane_bits) {
+    unsigned char out[16] __attribute__((aligned(16)));
+    if(lane_bits == 32) {
+        avg = _mm_packs_epi32(avg, avg);
+    }
+    _mm_store_si128((__m128i*)out, _mm_packus_epi16(avg, avg));
+    memcpy(dst, out, n);
+}
+
+__attribute__((target("sse2")))
+static void downscale_box_sse2(unsigned char *dst, int width, const unsigned char *src, int src_stride, int src_width, int src_rows, int factor) {
+    __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1), sum_lo, sum_hi, sum, pixels;
+    int x = 0, r, n = 16 / factor, shift = factor == 2 ? 2 : (factor == 4 ? 4 : 6);
+    for(; src_rows >= factor && x + n <= width && (x + n) * factor <= src_width; x += n) {
+        sum_lo = sum_hi = zero;
+        for(r = 0; r < factor; r++) {
+            pixels = _mm_loadu_si128((const __m128i*)(src + r * src_stride + x * factor));
+            sum_lo = _mm_add_epi16(sum_lo, _mm_unpacklo_epi8(pixels, zero));
+            sum_hi = _mm_add_epi16(sum_hi, _mm_unpackhi_epi8(pixels, zero));
+        }
+        // Add up the columns pairwise until there's one sum per block,
+        // the sums of 8 x 8 pixels still fit in 16 bits
+        sum = _mm_packs_epi32(_mm_madd_epi16(sum_lo, ones), _mm_madd_epi16(sum_hi, ones));
+        if(factor == 2) {
+            sum = _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+            store_averages_sse2(dst + x, sum, n, 16);
+            continue;
+        }
+        sum = _mm_madd_epi16(sum, ones);
+        if(factor == 8) {
+            sum = _mm_madd_epi16(_mm_packs_epi32(sum, sum), ones);
+        }
+        sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(1 << (shift - 1))), shift);
+        store_averages_sse2(dst + x, sum, n, 32);
+    }
+    downscale_box_scalar(dst + x, width - x, src + x * factor, src_stride, src_width - x * factor, src_rows, factor);
+}
+
+// The column sums are shifted so that the middle columns of each block make
+// a pair, and the pairs are added up
+__attribute__((target("sse2")))
+static void downscale_bilinear_sse2(unsigned char *dst, int width, const unsigned char *src, int src_stride, int src_width, int src_rows, int factor) {
+    const unsigned char *row0 = src + (factor / 2 - 1) * src_stride, *row1 = row0 + src_stride;
+    __m128i zero = _mm_setzero_si128(), ones = _mm_set1_epi16(1), p0, p1, sum_lo, sum_hi, sum;
+    int x = 0, n = 16 / factor;
+    if(factor == 2) {
+        downscale_box_sse2(dst, width, src, src_stride, src_width, src_rows, factor);
+        return;
+    }
+    for(; src_rows >= factor && x + n <= width && (x + n) * factor <= src_width; x += n) {
+        p0 = _mm_loadu_si128((const __m128i*)(row0 + x * factor));
+        p1 = _mm_loadu_si128((const __m128i*)(row1 + x * factor));
+        sum_lo = _mm_add_epi16(_mm_unpacklo_epi8(p0, zero), _mm_unpacklo_epi8(p1, zero));
+        sum_hi = _mm_add_epi16(_mm_unpackhi_epi8(p0, zero), _mm_unpackhi_epi8(p1, zero));
+        if(factor == 4) {
+            // Columns 1 and 2 of the two blocks in each half
+            sum_lo = _mm_shuffle_epi32(_mm_madd_epi16(_mm_srli_si128(sum_lo, 2), ones), _MM_SHUFFLE(3, 1, 2, 0));
+            sum_hi = _mm_shuffle_epi32(_mm_madd_epi16(_mm_srli_si128(sum_hi, 2), ones), _MM_SHUFFLE(3, 1, 2, 0));
+            sum = _mm_unpacklo_epi64(sum_lo, sum_hi);
+        } else {
+            // Columns 3 and 4 of the block in each half
+            sum_lo = _mm_madd_epi16(_mm_srli_si128(sum_lo, 6), ones);
+            sum_hi = _mm_madd_epi16(_mm_srli_si128(sum_hi, 6), ones);
+            sum = _mm_unpacklo_epi32(sum_lo, sum_hi);
+        }
+        sum = _mm_srli_epi32(_mm_add_epi32(sum, _mm_set1_epi32(2)), 2);
+        store_averages_sse2(dst + x, sum, n, 32);
+    }
+    downscale_bilinear_scalar(dst + x, width - x, src + x * factor, src_stride, src_width - x * factor, src_rows, factor);
+}
+
+// Interleaving row pairs by 8, 16 and 32 bits leaves the columns of the tile
+// in the halves of the registers
+__attribute__((target("sse2")))
+static inline void transpose_8x8_sse2(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride) {
+    __m128i r01 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)src),
+                                    _mm_loadl_epi64((const __m128i*)(src + src_stride)));
+    __m128i r23 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + 2 * src_stride)),
+                                    _mm_loadl_epi64((const __m128i*)(src + 3 * src_stride)));
+    __m128i r45 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + 4 * src_stride)),
+                                    _mm_loadl_epi64((const __m128i*)(src + 5 * src_stride)));
+    __m128i r67 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(src + 6 * src_stride)),
+                                    _mm_loadl_epi64((const __m128i*)(src + 7 * src_stride)));
+    __m128i c0123_lo = _mm_unpacklo_epi16(r01, r23), c4567_lo = _mm_unpackhi_epi16(r01, r23);
+    __m128i c0123_hi = _mm_unpacklo_epi16(r45, r67), c4567_hi = _mm_unpackhi_epi16(r45, r67);
+    __m128i c01 = _mm_unpacklo_epi32(c0123_lo, c0123_hi), c23 = _mm_unpackhi_epi32(c0123_lo, c0123_hi);
+    __m128i c45 = _mm_unpacklo_epi32(c4567_lo, c4567_hi), c67 = _mm_unpackhi_epi32(c4567_lo, c4567_hi);
+    _mm_storel_epi64((__m128i*)dst,                    c01);
+    _mm_storel_epi64((__m128i*)(dst + dst_stride),     _mm_unpackhi_epi64(c01, c01));
+    _mm_storel_epi64((__m128i*)(dst + 2 * dst_stride), c23);
+    _mm_storel_epi64((__m128i*)(dst + 3 * dst_stride), _mm_unpackhi_epi64(c23, c23));
+    _mm_storel_epi64((__m128i*)(dst + 4 * dst_stride), c45);
+    _mm_storel_epi64((__m128i*)(dst + 5 * dst_stride), _mm_unpackhi_epi64(c45, c45));
+    _mm_storel_epi64((__m128i*)(dst + 6 * dst_stride), c67);
+    _mm_storel_epi64((__m128i*)(dst + 7 * dst_stride), _mm_unpackhi_epi64(c67, c67));
+}
+
+// Same tiling as transpose_neon()
+__attribute__((target("sse2")))
+static void transpose_sse2(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows) {
+    int x, y;
+    for(x = 0; x + 8 <= width; x += 8) {
+        for(y = 0; y + 8 <= rows; y += 8) {
+            transpose_8x8_sse2(dst + x * dst_stride + y, dst_stride, src + y * src_stride + x, src_stride);
+        }
+        transpose_scalar(dst + x * dst_stride + y, dst_stride, src + y * src_stride + x, src_stride, 8, rows - y);
+    }
+    transpose_scalar(dst + x * dst_stride, dst_stride, src + x, src_stride, width - x, rows);
+}
+
+// SSE2 has no byte shuffle, the dwords are reversed first and then the words
+// of each dword and the bytes of each word are swapped
+__attribute__((target("sse2")))
+static void reverse_row_sse2(unsigned char *dst, const unsigned char *src, int width) {
+    int x;
+    for(x = 0; x + 16 <= width; x += 16) {
+        __m128i a = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)(src + width - 16 - x)), _MM_SHUFFLE(0, 1, 2, 3));
+        a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(a, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8)));
+    }
+    reverse_row_scalar(dst + x, src, width - x);
+}
+
+__attribute__((target("avx2")))
+static void unpack_rows_avx2(unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int width, int rows) {
+    int x;
+    for(; rows > 0; rows--) {
+        for(x = 0; x + 128 <= width; x += 128) {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(src + x));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(src + x + 32));
+            __m256i c = _mm256_loadu_si256((const __m256i*)(src + x + 64));
+            __m256i d = _mm256_loadu_si256((const __m256i*)(src + x + 96));
+            _mm256_storeu_si256((__m256i*)(dst + x), a);
+            _mm256_storeu_si256((__m256i*)(dst + x + 32), b);
+            _mm256_storeu_si256((__m256i*)(dst + x + 64), c);
+            _mm256_storeu_si256((__m256i*)(dst + x + 96), d);
+        }
+        for(; x + 32 <= width; x += 32) {
+            _mm256_storeu_si256((__m256i*)(dst + x), _mm256_loadu_si256((const __m256i*)(src + x)));
+        }
+        memcpy(dst + x, src + x, width - x);
+        dst += dst_stride;
+        src += src_stride;
+    }
+}
+
+__attribute__((target("avx2")))
+static void interleave_uv_avx2(unsigned char *dst, const unsigned char *u, const unsigned char *v, int width) {
+    int x;
+    for(x = 0; x + 32 <= width; x += 32) {
+        __m256i uu = _mm256_loadu_si256((const __m256i*)(u + x));
+        __m256i vv = _mm256_loadu_si256((const __m256i*)(v + x));
+        // The unpacks work within the 128 bit lanes, put the lanes back in order
+        __m256i lo = _mm256_unpacklo_epi8(uu, vv), hi = _mm256_unpackhi_epi8(uu, vv);
+        _mm256_storeu_si256((__m256i*)(dst + 2 * x), _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i*)(dst + 2 * x + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    interleave_uv_sse2(dst + 2 * x, u + x, v + x, width - x);
+}
+
+static int cpu_has_sse2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int cpu_has_avx2(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// Best first, the scalar kernel is always supported. The AVX2 kernel uses
+// the SSE2 conversions where 256 bit registers don't pay off.
+typedef struct {
+    const char *name;
+    unpack_rows_fn unpack_rows;
+    interleave_uv_fn interleave_uv;
+    convert_row_fn pack_yuy2;
+    convert_row_fn yuv_to_rgb24;
+    convert_row_fn yuv_to_bgra;
+    downscale_row_fn downscale_box;
+    downscale_row_fn downscale_bilinear;
+    transpose_fn transpose;
+    reverse_row_fn reverse_row;
+    int (*supported)(void);
+} unpack_kernel;
+static const unpack_kernel unpack_kernels[] = {
+#ifdef HAVE_NEON_KERNELS
+    { "NEON",   unpack_rows_neon,   interleave_uv_neon,   pack_yuy2_neon,   yuv_to_rgb24_neon,   yuv_to_bgra_neon,
+                downscale_box_neon,   downscale_bilinear_neon,   transpose_neon,   reverse_row_neon,   cpu_has_neon },
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+    { "AVX2",   unpack_rows_avx2,   interleave_uv_avx2,   pack_yuy2_sse2,   yuv_to_rgb24_sse2,   yuv_to_bgra_sse2,
+                downscale_box_sse2,   downscale_bilinear_sse2,   transpose_sse2,   reverse_row_sse2,   cpu_has_avx2 },
+    { "SSE2",   unpack_rows_sse2,   interleave_uv_sse2,   pack_yuy2_sse2,   yuv_to_rgb24_sse2,   yuv_to_bgra_sse2,
+                downscale_box_sse2,   downscale_bilinear_sse2,   transpose_sse2,   reverse_row_sse2,   cpu_has_sse2 },
+#endif
+    { "scalar", unpack_rows_scalar, interleave_uv_scalar, pack_yuy2_scalar, yuv_to_rgb24_scalar, yuv_to_bgra_scalar,
+                downscale_box_scalar, downscale_bilinear_scalar, transpose_scalar, reverse_row_scalar, NULL },
+};
+#define UNPACK_KERNEL_COUNT (int)(sizeof(unpack_kernels) / sizeof(unpack_kernels[0]))
+
+static const unpack_kernel *select_unpack_kernel(void) {
+    int i;
+    for(i = 0; i < UNPACK_KERNEL_COUNT - 1; i++) {
+        if(unpack_kernels[i].supported()) {
+            break;
+        }
+    }
+    return &unpack_kernels[i];
+}
+
+// Copy rows of a plane span whatever the strides of the buffer and the frame
+// are, a frame row wider than the buffer row is padded with zeros. Inlined so
+// that constant strides pick the copy at compile time.
+static inline void unpack_plane_span(const unpack_kernel *kernel, unsigned char *dst, int dst_stride, const unsigned char *src, int src_stride, int rows) {
+    int row;
+    if(dst_stride == src_stride) {
+        // No stride to drop, copy the plane span in one go
+        kernel->unpack_rows(dst, 0, src, 0, dst_stride * rows, 1);
+    } else if(dst_stride < src_stride) {
+        kernel->unpack_rows(dst, dst_stride, src, src_stride, dst_stride, rows);
+    } else {
+        kernel->unpack_rows(dst, dst_stride, src, src_stride, src_stride, rows);
+        for(row = 0; row < rows; row++) {
+            memset(dst + row * dst_stride + src_stride, 0, dst_stride - src_stride);
+        }
+    }
+}
+
+// Interleave rows of U and V spans to a plane span of NV12 chroma
+static void interleave_uv_span(const unpack_kernel *kernel, unsigned char *dst, int dst_stride, int dst_width,
+        const unsigned char *src_u, const unsigned char *src_v, int src_stride, int rows) {
+    int row;
+    for(row = 0; row < rows; row++) {
+        kernel->interleave_uv(dst, src_u, src_v, dst_width / 2);
+        memset(dst + dst_width, 0, dst_stride - dst_width);
+        dst += dst_stride;
+        src_u += src_stride;
+        src_v += src_stride;
+    }
+}
+
+// Convert the rows of slice buf_num to one of the other output formats, see
+// unpack_slice(). The padding at the end of the rows is zeroed. The spans of
+// the planes the format doesn't have aren't read at all.
+static void convert_slice(const unpack_kernel *kernel, unsigned char *frame, const i420_frame_info *frame_info,
+        const unsigned char *buf_start, const i420_frame_info *buf_info, int buf_num, int valid_spans_y) {
+    int max_spans_y = buf_info->height, max_spans_uv = max_spans_y / 2;
+    int valid_spans_uv = (valid_spans_y + 1) / 2;
+    int stride = frame_info->p_stride[0], padding = stride - frame_info->p_width[0];
+    int row;
+    const unsigned char *src_y = buf_start + buf_info->p_offset[0];
+    const unsigned char *src_u = buf_start + buf_info->p_offset[1];
+    const unsigned char *src_v = buf_start + buf_info->p_offset[2];
+    unsigned char *dst = frame + frame_info->p_offset[0] + buf_num * stride * max_spans_y;
+    convert_row_fn convert_row = NULL;
+    switch(frame_info->format) {
+        case OUTPUT_FORMAT_NV12:
+            // The Y plane is the same as in I420
+            unpack_plane_span(kernel, dst, stride, src_y, buf_info->p_stride[0], valid_spans_y);
+            interleave_uv_span(kernel, frame + frame_info->p_offset[1] + buf_num * frame_info->p_stride[1] * max_spans_uv,
+                frame_info->p_stride[1], frame_info->p_width[1], src_u, src_v, buf_info->p_stride[1], valid_spans_uv);
+            return;
+        case OUTPUT_FORMAT_Y:
+            unpack_plane_span(kernel, dst, stride, src_y, buf_info->p_stride[0], valid_spans_y);
+            return;
+        case OUTPUT_FORMAT_UV:
+            interleave_uv_span(kernel, frame + frame_info->p_offset[0] + buf_num * stride * max_spans_uv,
+                stride, frame_info->p_width[0], src_u, src_v, buf_info->p_stride[1], valid_spans_uv);
+            return;
+        case OUTPUT_FORMAT_YUY2:
+            convert_row = kernel->pack_yuy2;
+            break;
+        case OUTPUT_FORMAT_RGB24:
+            convert_row = kernel->yuv_to_rgb24;
+            break;
+        case OUTPUT_FORMAT_BGRA:
+            convert_row = kernel->yuv_to_bgra;
+            break;
+        default:
+            return;
+    }
+    // A chroma row covers two rows of pixels
+    for(row = 0; row < valid_spans_y; row++) {
+        convert_row(dst, src_y, src_u + (row / 2) * buf_info->p_stride[1], src_v + (row / 2) * buf_info->p_stride[2], frame_info->width);
+        memset(dst + frame_info->p_width[0], 0, padding);
+        dst += stride;
+        src_y += buf_info->p_stride[0];
+    }
+}
+
+// Rotate the plane spans of slice buf_num from the buffer to the frame, see
+// unpack_slice(). With 90 and 270 degrees the slice is a band of columns of
+// the rotated frame, which is transposed a strip of tiles at a time while the
+// slice is in the cache. The slice at the right edge of the band zeroes the
+// padding at the end of the rows. Returns the number of bytes written, frame
+// can be NULL to just count them.
+static size_t rotate_slice(const unpack_kernel *kernel, unsigned char *frame, const i420_frame_info *frame_info,
+        const unsigned char *buf_start, const i420_frame_info *buf_info, int buf_num, int valid_spans_y) {
+    int max_spans_y = buf_info->height, valid_spans_uv = (valid_spans_y + 1) / 2;
+    int transposed = (frame_info->rotation == 90 || frame_info->rotation == 270);
+    // Size of the frame before the rotation
+    int width = (transposed ? frame_info->height : frame_info->width);
+    int height = (transposed ? frame_info->width : frame_info->height);
+    int chroma, src_width, src_height, first, rows, src_stride, dst_stride, padding, edge, i, row;
+    const unsigned char *src;
+    unsigned char *dst;
+    size_t bytes = 0;
+    // The planes of I420 and Y are the first planes of the buffer
+    for(i = 0; i < frame_info->planes; i++) {
+        chroma = is_chroma_plane(frame_info, i);
+        src_width  = (chroma ? (width + 1) / 2  : width);
+        src_height = (chroma ? (height + 1) / 2 : height);
+        first = buf_num * (chroma ? max_spans_y / 2 : max_spans_y);
+        rows = (chroma ? valid_spans_uv : valid_spans_y);
+        src = buf_start + buf_info->p_offset[i];
+        src_stride = buf_info->p_stride[i];
+        dst = frame + frame_info->p_offset[i];
+        dst_stride = frame_info->p_stride[i];
+        padding = dst_stride - frame_info->p_width[i];
+        if(!transposed) {
+            bytes += dst_stride * rows;
+            if(!frame) {
+                continue;
+            }
+            // The last row of the slice is the first row of the frame span
+            dst += (src_height - first - rows) * dst_stride;
+            for(row = rows - 1; row >= 0; row--) {
+                kernel->reverse_row(dst, src + row * src_stride, src_width);
+                memset(dst + src_width, 0, padding);
+                dst += dst_stride;
+            }
+            continue;
+        }
+        edge = (frame_info->rotation == 90 ? first == 0 : first + rows == src_height);
+        bytes += (rows + (edge ? padding : 0)) * src_width;
+        if(!frame) {
+            continue;
+        }
+        if(frame_info->rotation == 90) {
+            // Clockwise, the rows of the slice are read bottom up
+            kernel->transpose(dst + src_height - first - rows, dst_stride, src + (rows - 1) * src_stride, -src_stride, src_width, rows);
+        } else {
+            // Counterclockwise, the rows of the frame are written bottom up
+            kernel->transpose(dst + (src_width - 1) * dst_stride + first, -dst_stride, src, src_stride, src_width, rows);
+        }
+        if(edge && padding) {
+            for(row = 0; row < src_width; row++) {
+                memset(dst + row * dst_stride + frame_info->p_width[i], 0, padding);
+            }
+        }
+    }
+    return bytes;
+}
+
+// Unpack Y, U, and V plane spans of slice buf_num from the buffer to the
+// frame, converting them to the format of the frame and rotating them. Only
+// valid_spans_y rows of Y are valid in the short last slice of the frame, the last row of U and
+// V covers the odd last row of Y. Returns the number of bytes unpacked, frame
+// can be NULL to just count them.
+static size_t unpack_slice(const unpack_kernel *kernel, unsigned char *frame, const i420_frame_info *frame_info,
+        const unsigned char *buf_start, const i420_frame_info *buf_info, int buf_num, int valid_spans_y) {
+    // I420 spec: U and V plane span size half of the size of the Y plane span size
+    int max_spans_y = buf_info->height, max_spans_uv = max_spans_y / 2;
+    int valid_spans_uv = (valid_spans_y + 1) / 2;
+    int max_spans, valid_spans, dst_stride, i;
+    size_t bytes = 0;
+    if(frame_info->rotation) {
+        return rotate_slice(kernel, frame, frame_info, buf_start, buf_info, buf_num, valid_spans_y);
+    }
+    for(i = 0; i < frame_info->planes; i++) {
+        bytes += frame_info->p_stride[i] * (is_chroma_plane(frame_info, i) ? valid_spans_uv : valid_spans_y);
+    }
+    if(!frame) {
+        return bytes;
+    }
+    if(frame_info->format != OUTPUT_FORMAT_I420) {
+        convert_slice(kernel, frame, frame_info, buf_start, buf_info, buf_num, valid_spans_y);
+        return bytes;
+    }
+    for(i = 0; i < 3; i++) {
+        // Number of maximum and valid spans for this plane
+        max_spans   = (i == 0 ? max_spans_y   : max_spans_uv);
+        valid_spans = (i == 0 ? valid_spans_y : valid_spans_uv);
+        dst_stride = frame_info->p_stride[i];
+        // Start of the plane span in the I420 frame, after the plane spans
+        // copied from the previous buffers, and in the buffer
+        unpack_plane_span(kernel, frame + frame_info->p_offset[i] + buf_num * dst_stride * max_spans, dst_stride,
+            buf_start + buf_info->p_offset[i], buf_info->p_stride[i], valid_spans);
+    }
+    return bytes;
+}
+
+// Unpacks an I420 slice like unpack_slice() with a layout known at compile
+// time. The planes are unrolled and the offsets, the strides and the choice
+// of copy in unpack_plane_span() are all constants.
+static inline __attribute__((always_inline)) size_t unpack_i420_slice_fixed(const unpack_kernel *kernel, unsigned char *frame,
+        const i420_frame_info *frame_info, const unsigned char *buf_start, const i420_frame_info *buf_info, int buf_num, int valid_spans_y) {
+    int max_spans_y = buf_info->height, max_spans_uv = max_spans_y / 2;
+    int valid_spans_uv = (valid_spans_y + 1) / 2;
+    if(frame) {
+        unpack_plane_span(kernel, frame + frame_info->p_offset[0] + buf_num * frame_info->p_stride[0] * max_spans_y, frame_info->p_stride[0],
+            buf_start + buf_info->p_offset[0], buf_info->p_stride[0], valid_spans_y);
+        unpack_plane_span(kernel, frame + frame_info->p_offset[1] + buf_num * frame_info->p_stride[1] * max_spans_uv, frame_info->p_stride[1],
+            buf_start + buf_info->p_offset[1], buf_info->p_stride[1], valid_spans_uv);
+        unpack_plane_span(kernel, frame + frame_info->p_offset[2] + buf_num * frame_info->p_stride[2] * max_spans_uv, frame_info->p_stride[2],
+            buf_start + buf_info->p_offset[2], buf_info->p_stride[2], valid_spans_uv);
+    }
+    return (size_t)frame_info->p_stride[0] * valid_spans_y + (size_t)(frame_info->p_stride[1] + frame_info->p_stride[2]) * valid_spans_uv;
+}
+
+// Layouts of the I420 frames of the modes we usually capture at, worked out
+// at compile time for OUTPUT_ALIGNMENT and the slices of the camera, whose
+// stride is aligned to 32 and slice height is 16. Each layout gets an unpack
+// routine of its own. See select_fixed_layout().
+typedef size_t (*unpack_slice_fixed_fn)(const unpack_kernel *kernel, unsigned char *frame, const unsigned char *buf_start, int buf_num, int valid_spans_y);
+typedef struct {
+    const char *name;
+    const i420_frame_info *frame_info;
+    const i420_frame_info *buf_info;
+    unpack_slice_fixed_fn unpack_slice;
+} fixed_layout;
+#define FIXED_LAYOUT(name, width, height) \
+    static const i420_frame_info name##_frame_info = I420_FRAME_INFO(width, height, OUTPUT_ALIGNMENT, ROUND_UP_N(width, 32), 16); \
+    static const i420_frame_info name##_buf_info = I420_FRAME_INFO(ROUND_UP_N(width, 32), 16, 4, -1, -1); \
+    static size_t unpack_slice_##name(const unpack_kernel *kernel, unsigned char *frame, const unsigned char *buf_start, int buf_num, int valid_spans_y) { \
+        return unpack_i420_slice_fixed(kernel, frame, &name##_frame_info, buf_start, &name##_buf_info, buf_num, valid_spans_y); \
+    }
+FIXED_LAYOUT(layout_1080p, 1920, 1080)
+FIXED_LAYOUT(layout_720p,  1280, 720)
+FIXED_LAYOUT(layout_270p,  480,  270)
+static const fixed_layout fixed_layouts[] = {
+    { "1080p",   &layout_1080p_frame_info, &layout_1080p_buf_info, unpack_slice_layout_1080p },
+    { "720p",    &layout_720p_frame_info,  &layout_720p_buf_info,  unpack_slice_layout_720p },
+    { "480x270", &layout_270p_frame_info,  &layout_270p_buf_info,  unpack_slice_layout_270p },
+};
+#define FIXED_LAYOUT_COUNT (int)(sizeof(fixed_layouts) / sizeof(fixed_layouts[0]))
+
+static int same_frame_info(const i420_frame_info *a, const i420_frame_info *b) {
+    int i;
+    if(a->format != b->format || a->width != b->width || a->height != b->height || a->size != b->size
+            || a->buf_stride != b->buf_stride || a->buf_slice_height != b->buf_slice_height
+            || a->buf_extra_padding != b->buf_extra_padding || a->planes != b->planes || a->rotation != b->rotation) {
+        return 0;
+    }
+    for(i = 0; i < 3; i++) {
+        if(a->p_offset[i] != b->p_offset[i] || a->p_stride[i] != b->p_stride[i]
+                || a->p_width[i] != b->p_width[i] || a->p_height[i] != b->p_height[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Returns the fixed layout of the frame and the buffers, or NULL if there's
+// none and the frames have to be unpacked with unpack_slice()
+static const fixed_layout *select_fixed_layout(const i420_frame_info *frame_info, const i420_frame_info *buf_info) {
+    int i;
+    for(i = 0; i < FIXED_LAYOUT_COUNT; i++) {
+        if(same_frame_info(frame_info, fixed_layouts[i].frame_info) && same_frame_info(buf_info, fixed_layouts[i].buf_info)) {
+            return &fixed_layouts[i];
+        }
+    }
+    return NULL;
+}
+
+// Downscale the Y, U, and V plane spans of slice buf_num from the buffer to
+// the reduced I420 frame, factor times smaller. The spans are still in the
+// cache after unpacking them, the full frame isn't read again. The slice
+// height is a multiple of twice the factor, so that no block straddles two
+// slices.
+static void downscale_slice(downscale_row_fn downscale_row, int factor, unsigned char *reduced, const i420_frame_info *reduced_info,
+        const unsigned char *buf_start, const i420_frame_info *buf_info, int width, int buf_num, int valid_spans_y) {
+    int max_spans_y = buf_info->height, max_spans_uv = max_spans_y / 2;
+    int valid_spans_uv = (valid_spans_y + 1) / 2;
+    int max_spans, valid_spans, first_row, row, i;
+    for(i = 0; i < 3; i++) {
+        max_spans   = (i == 0 ? max_spans_y   : max_spans_uv);
+        valid_spans = (i == 0 ? valid_spans_y : valid_spans_uv);
+        // Rows of the reduced plane whose blocks start in this slice
+        first_row = buf_num * max_spans;
+        for(row = first_row / factor; row < reduced_info->p_height[i] && row * factor < first_row + valid_spans; row++) {
+            downscale_row(reduced + reduced_info->p_offset[i] + row * reduced_info->p_stride[i], reduced_info->p_width[i],
+                buf_start + buf_info->p_offset[i] + (row * factor - first_row) * buf_info->p_stride[i], buf_info->p_stride[i],
+                i == 0 ? width : (width + 1) / 2, first_row + valid_spans - row * factor, factor);
+        }
+    }
+}
+
+// Region of the frame written as an I420 stream of its own, see
+// REGIONS_OF_INTEREST
+typedef struct {
+    int x;
+    int y;
+    int width;
+    int height;
+    const char *file;
+} region_of_interest;
+static const region_of_interest regions_of_interest[] = REGIONS_OF_INTEREST;
+#define REGION_OF_INTEREST_COUNT (int)(sizeof(regions_of_interest) / sizeof(regions_of_interest[0]))
+
+typedef struct {
+    region_of_interest region;
+    i420_frame_info frame_info;
+    FILE *fd;
+    int pool_size;
+    frame_pool frames;
+    frame_writer writer;
+    unsigned char *frame;   // being unpacked, NULL if dropped
+    // Statistics
+    unsigned int slices_copied;
+    unsigned int slices_skipped;
+} roi_output;
+
+// Clips the region to the frame. The corner is rounded down to even
+// coordinates so that the chroma samples of the region line up with the
+// ones of the frame. Returns 0 if nothing of the region is left.
+static int clip_region_of_interest(region_of_interest *region, int width, int height) {
+    region->x &= ~1;
+    region->y &= ~1;
+    if(region->x < 0 || region->y < 0 || region->x >= width || region->y >= height) {
+        return 0;
+    }
+    if(region->x + region->width > width) {
+        region->width = width - region->x;
+    }
+    if(region->y + region->height > height) {
+        region->height = height - region->y;
+    }
+    return region->width > 0 && region->height > 0;
+}
+
+// Copy the rows and the columns of slice buf_num that intersect the region
+// to the I420 frame of the region. A slice above or below the region is
+// skipped without touching it. Returns the number of bytes copied.
+static size_t unpack_roi_slice(const unpack_kernel *kernel, roi_output *roi,
+        const unsigned char *buf_start, const i420_frame_info *buf_info, int buf_num, int valid_spans_y) {
+    const i420_frame_info *info = &roi->frame_info;
+    int max_spans_y = buf_info->height, max_spans_uv = max_spans_y / 2;
+    int valid_spans_uv = (valid_spans_y + 1) / 2;
+    int max_spans, valid_spans, roi_x, roi_y, first_row, last_row, slice_row, i;
+    size_t bytes = 0;
+    slice_row = buf_num * max_spans_y;
+    if(slice_row >= roi->region.y + roi->region.height || slice_row + valid_spans_y <= roi->region.y) {
+        roi->slices_skipped++;
+        return 0;
+    }
+    roi->slices_copied++;
+    for(i = 0; i < 3; i++) {
+        max_spans   = (i == 0 ? max_spans_y   : max_spans_uv);
+        valid_spans = (i == 0 ? valid_spans_y : valid_spans_uv);
+        roi_x = (i == 0 ? roi->region.x : roi->region.x / 2);
+        roi_y = (i == 0 ? roi->region.y : roi->region.y / 2);
+        // Rows of the plane in both the slice and the region
+        slice_row = buf_num * max_spans;
+        first_row = slice_row > roi_y ? slice_row : roi_y;
+        last_row = slice_row + valid_spans < roi_y + info->p_height[i] ? slice_row + valid_spans : roi_y + info->p_height[i];
+        if(first_row >= last_row) {
+            continue;
+        }
+        kernel->unpack_rows(roi->frame + info->p_offset[i] + (first_row - roi_y) * info->p_stride[i], info->p_stride[i],
+            buf_start + buf_info->p_offset[i] + (first_row - slice_row) * buf_info->p_stride[i] + roi_x, buf_info->p_stride[i],
+            info->p_width[i], last_row - first_row);
+        bytes += info->p_width[i] * (last_row - first_row);
+    }
+    return bytes;
 }
 
 // Ugly, stupid utility functions
@@ -153,6 +1492,265 @@ static void die(const char* message, ...) {
     exit(1);
 }
 
+static unsigned long long get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Apply the scheduling policy, priority and CPU affinity configured
+// for a thread role to the calling thread. Failing to do so, e.g. for
+// the lack of privileges for real-time scheduling, isn't fatal.
+static void set_thread_scheduling(const char *role, int policy, int priority, int cpu) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int r;
+    say("Scheduling the %s thread with policy %d, priority %d, CPU %d", role, policy, priority, cpu);
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if((r = pthread_setschedparam(pthread_self(), policy, &param)) != 0) {
+        say("Failed to set scheduling policy of the %s thread: %s", role, strerror(r));
+    }
+    if(cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if((r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0) {
+            say("Failed to set CPU affinity of the %s thread: %s", role, strerror(r));
+        }
+    }
+}
+
+// OMX calls the handlers from its own thread, so the settings
+// are applied by the first handler called in that thread
+static __thread int callback_thread_configured = 0;
+static void configure_callback_thread(void) {
+    if(!callback_thread_configured) {
+        callback_thread_configured = 1;
+        set_thread_scheduling("OMX callback", CALLBACK_THREAD_POLICY, CALLBACK_THREAD_PRIORITY, CALLBACK_THREAD_CPU);
+    }
+}
+
+// Allocates the metadata of all the buffers of a port at once
+static buffer_meta *alloc_buffer_meta(int count) {
+    buffer_meta *meta = calloc(count, sizeof(buffer_meta));
+    int i;
+    if(!meta) {
+        die("Failed to allocate metadata for %d buffers", count);
+    }
+    for(i = 0; i < count; i++) {
+        meta[i].buffer_index = i;
+    }
+    return meta;
+}
+
+// Called right before the buffer is handed to the component
+static void mark_buffer_enqueued(OMX_BUFFERHEADERTYPE *buffer) {
+    BUFFER_META(buffer)->enqueue_ns = get_time_ns();
+}
+
+// Called by the buffer done handlers when the component returns the buffer
+static void mark_buffer_dequeued(OMX_BUFFERHEADERTYPE *buffer) {
+    buffer_meta *meta = BUFFER_META(buffer);
+    meta->dequeue_ns = get_time_ns();
+    meta->timestamp = buffer->nTimeStamp;
+    meta->flags = buffer->nFlags;
+    meta->sequence++;
+}
+
+static long long get_timestamp_us(OMX_TICKS ticks) {
+#ifdef OMX_SKIP64BIT
+    return ((long long)ticks.nHighPart << 32) | ticks.nLowPart;
+#else
+    return ticks;
+#endif
+}
+
+// Allocates memory for frames. With LOCKED_FRAME_MEMORY the memory is mapped
+// from huge pages, or from transparent huge pages if there are none, and
+// locked so that it is neither paged out nor faulted in while capturing.
+// The memory is page aligned. Sets mapped_size to the size of the mapping,
+// 0 if the memory was allocated with posix_memalign().
+static void *alloc_frame_memory(size_t size, size_t *mapped_size) {
+    void *memory;
+    *mapped_size = 0;
+    if(!LOCKED_FRAME_MEMORY) {
+        return posix_memalign(&memory, sysconf(_SC_PAGESIZE), size) == 0 ? memory : NULL;
+    }
+    *mapped_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+    memory = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(memory == MAP_FAILED) {
+        say("Failed to map %zu bytes of frame memory from huge pages, using transparent huge pages: %s", *mapped_size, strerror(errno));
+        memory = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED) {
+            die("Failed to map %zu bytes of frame memory: %s", *mapped_size, strerror(errno));
+        }
+        if(madvise(memory, *mapped_size, MADV_HUGEPAGE) != 0) {
+            say("Failed to enable transparent huge pages for frame memory: %s", strerror(errno));
+        }
+    }
+    // Also faults in all the pages up front
+    if(mlock(memory, *mapped_size) != 0) {
+        say("Failed to lock %zu bytes of frame memory, it may be paged out: %s", *mapped_size, strerror(errno));
+    }
+    return memory;
+}
+
+static void free_frame_memory(void *memory, size_t mapped_size) {
+    if(mapped_size) {
+        munlock(memory, mapped_size);
+        munmap(memory, mapped_size);
+    } else {
+        free(memory);
+    }
+}
+
+// Page faults of the process so far, read at the start and at the end of the loop
+static void get_page_faults(long *minor, long *major) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        *minor = *major = -1;
+        return;
+    }
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+}
+
+// Measures the unpack kernels with the slice layout of the camera
+// at a few frame sizes, see UNPACK_BENCHMARK. The reduced copy is
+// downscaled too if it's enabled. I420 and Y are rotated by each
+// of the angles too. The sizes with a fixed layout are unpacked
+// with both the generic and the fixed layout.
+static void benchmark_unpack_kernels(void) {
+    static const int sizes[][2] = { { 480, 270 }, { 1280, 720 }, { 1920, 1080 } };
+    static const int rotations[] = { 0, 90, 180, 270 };
+    i420_frame_info frame_info, buf_info, reduced_info;
+    unsigned char *frame, *buf, *reduced = NULL;
+    unsigned long long start_ns, elapsed_ns;
+    unsigned long long generic_ns = 0;
+    int size, rotation, rotation_count, k, fixed, n, slice, slices, valid_spans_y, downscale_factor = DOWNSCALE_FACTOR;
+    char downscale[64] = "", rotated[32] = "";
+    downscale_row_fn downscale_row;
+    const fixed_layout *layout;
+    rotation_count = (OUTPUT_FORMAT == OUTPUT_FORMAT_I420 || OUTPUT_FORMAT == OUTPUT_FORMAT_Y ? 4 : 1);
+    for(size = 0; size < (int)(sizeof(sizes) / sizeof(sizes[0])); size++) {
+        for(rotation = 0; rotation < rotation_count; rotation++) {
+            // The camera aligns the stride to 32 and slices the frame by 16 rows
+            get_output_frame_info(OUTPUT_FORMAT, sizes[size][0], sizes[size][1], OUTPUT_ALIGNMENT, (sizes[size][0] + 31) & ~31, 16, &frame_info);
+            get_i420_frame_info(frame_info.buf_stride, frame_info.buf_slice_height, 4, -1, -1, &buf_info);
+            slices = (frame_info.height + frame_info.buf_slice_height - 1) / frame_info.buf_slice_height;
+            rotate_frame_info(&frame_info, rotations[rotation], OUTPUT_ALIGNMENT);
+            if(rotations[rotation]) {
+                snprintf(rotated, sizeof(rotated), " rotated by %d", rotations[rotation]);
+            } else {
+                rotated[0] = '\0';
+            }
+            frame = malloc(frame_info.size);
+            buf = malloc(buf_info.size);
+            if(!frame || !buf) {
+                die("Failed to allocate memory for the unpack benchmark");
+            }
+            memset(buf, 0x80, buf_info.size);
+            if(downscale_factor) {
+                get_i420_frame_info(sizes[size][0] / downscale_factor, sizes[size][1] / downscale_factor, 1, -1, -1, &reduced_info);
+                if(!(reduced = malloc(reduced_info.size))) {
+                    die("Failed to allocate memory for the unpack benchmark");
+                }
+                snprintf(downscale, sizeof(downscale), " and %dx %s", downscale_factor, downscale_filter_names[DOWNSCALE_FILTER]);
+            }
+            layout = select_fixed_layout(&frame_info, &buf_info);
+            for(k = 0; k < UNPACK_KERNEL_COUNT; k++) {
+                if(unpack_kernels[k].supported && !unpack_kernels[k].supported()) {
+                    continue;
+                }
+                downscale_row = (DOWNSCALE_FILTER == DOWNSCALE_BILINEAR ? unpack_kernels[k].downscale_bilinear : unpack_kernels[k].downscale_box);
+                // The generic layout first, then the fixed one if there's one
+                for(fixed = 0; fixed < (layout ? 2 : 1); fixed++) {
+                    start_ns = get_time_ns();
+                    for(n = 0; n < UNPACK_BENCHMARK_FRAMES; n++) {
+                        for(slice = 0; slice < slices; slice++) {
+                            valid_spans_y = buf_info.height - (slice == slices - 1 ? frame_info.buf_extra_padding : 0);
+                            if(fixed) {
+                                layout->unpack_slice(&unpack_kernels[k], frame, buf, slice, valid_spans_y);
+                            } else {
+                                unpack_slice(&unpack_kernels[k], frame, &frame_info, buf, &buf_info, slice, valid_spans_y);
+                            }
+                            if(reduced) {
+                                downscale_slice(downscale_row, downscale_factor, reduced, &reduced_info, buf, &buf_info, sizes[size][0], slice, valid_spans_y);
+                            }
+                        }
+                    }
+                    elapsed_ns = get_time_ns() - start_ns;
+                    // Headroom is how many times the unpacking fits in the frame interval
+                    say("Unpack %dx%d to %s%s%s with %s%s:\t%.2f GB/s, %.3f ms per frame, headroom %.0fx at %d fps",
+                        sizes[size][0], sizes[size][1], output_format_names[frame_info.format], rotated, downscale, unpack_kernels[k].name,
+                        fixed ? " and the fixed layout" : "",
+                        (double)frame_info.size * UNPACK_BENCHMARK_FRAMES / elapsed_ns,
+                        elapsed_ns / 1e6 / UNPACK_BENCHMARK_FRAMES,
+                        1e9 / VIDEO_FRAMERATE / ((double)elapsed_ns / UNPACK_BENCHMARK_FRAMES), VIDEO_FRAMERATE);
+                    if(fixed) {
+                        say("Fixed %s layout with %s:\t%+.1f us per frame against the generic layout",
+                            layout->name, unpack_kernels[k].name, ((double)elapsed_ns - generic_ns) / 1e3 / UNPACK_BENCHMARK_FRAMES);
+                    }
+                    generic_ns = elapsed_ns;
+                }
+            }
+            free(reduced);
+            free(buf);
+            free(frame);
+        }
+    }
+}
+
+// Called by the main loop for each frame
+static void add_frame_arrival(jitter_stats *jitter) {
+    unsigned long long now_ns = get_time_ns(), interval_ns, jitter_ns;
+    jitter->frames++;
+    if(jitter->last_ns) {
+        interval_ns = now_ns - jitter->last_ns;
+        if(jitter->last_interval_ns) {
+            jitter_ns = interval_ns > jitter->last_interval_ns
+                ? interval_ns - jitter->last_interval_ns
+                : jitter->last_interval_ns - interval_ns;
+            jitter->samples++;
+            jitter->sum_ns += jitter_ns;
+            if(jitter_ns > jitter->max_ns) {
+                jitter->max_ns = jitter_ns;
+            }
+            if(jitter_ns > JITTER_LOG_THRESHOLD * 1000000ULL) {
+                jitter->over_threshold++;
+                say("Frame %d arrived with %.1f ms jitter", jitter->frames, jitter_ns / 1e6);
+            }
+        }
+        jitter->last_interval_ns = interval_ns;
+    }
+    jitter->last_ns = now_ns;
+}
+
+static void dump_jitter_stats(const jitter_stats *jitter) {
+    say("Frame jitter:\n"
+        "\tAverage:\t\t%.1f us\n"
+        "\tMax:\t\t\t%.1f us\n"
+        "\tOver %d ms:\t\t%u of %u frames\n",
+            jitter->samples ? jitter->sum_ns / 1e3 / jitter->samples : 0.0,
+            jitter->max_ns / 1e3,
+            JITTER_LOG_THRESHOLD, jitter->over_threshold, jitter->samples);
+}
+
+// Frames and bytes written per second over the capture loop, for sizing the
+// storage the output goes to
+static void dump_throughput(const char *message, int frames, size_t frame_size, unsigned long long elapsed_ns) {
+    double seconds = elapsed_ns ? elapsed_ns / 1e9 : 1.0, bytes = (double)frames * frame_size;
+    say("%s throughput:\n"
+        "\tFrames written:\t\t%d of %d bytes in %.1f s\n"
+        "\tFrames per second:\t%.1f\n"
+        "\tBytes per second:\t%.0f, %.2f MB/s\n"
+        "\tBytes per hour:\t\t%.2f GB\n",
+            message, frames, frame_size, seconds,
+            frames / seconds,
+            bytes / seconds, bytes / seconds / 1e6,
+            bytes / seconds * 3600 / 1e9);
+}
+
 static void omx_die(OMX_ERRORTYPE error, const char* message, ...) {
     va_list args;
     char str[1024];
@@ -184,11 +1782,13 @@ static void dump_frame_info(const char *message, const i420_frame_info *info) {
         "\tBuffer slice height:\t%d\n"
         "\tBuffer extra padding:\t%d\n"
         "\tPlane strides:\t\tY:%d U:%d V:%d\n"
-        "\tPlane offsets:\t\tY:%d U:%d V:%d\n",
+        "\tPlane offsets:\t\tY:%d U:%d V:%d\n"
+        "\tPlane heights:\t\tY:%d U:%d V:%d\n",
             message,
             info->width, info->height, info->size, info->buf_stride, info->buf_slice_height, info->buf_extra_padding,
             info->p_stride[0], info->p_stride[1], info->p_stride[2],
-            info->p_offset[0], info->p_offset[1], info->p_offset[2]);
+            info->p_offset[0], info->p_offset[1], info->p_offset[2],
+            info->p_height[0], info->p_height[1], info->p_height[2]);
 }
 
 static void dump_event(OMX_HANDLETYPE hComponent, OMX_EVENTTYPE eEvent, OMX_U32 nData1, OMX_U32 nData2) {
@@ -382,49 +1982,480 @@ static void dump_port(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL du
     }
 }
 
-// Some busy loops to verify we're running in order
-static void block_until_state_changed(OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState) {
-    OMX_STATETYPE eState;
-    int i = 0;
-    while(i++ == 0 || eState != wanted_eState) {
-        OMX_GetState(hComponent, &eState);
-        if(eState != wanted_eState) {
-            usleep(10000);
-        }
-    }
-}
-
-static void block_until_port_changed(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled) {
+// Fills in a buffer plan entry for a port from its port definition
+static void init_port_plan(buffer_plan *plan, const char *name, OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex) {
     OMX_ERRORTYPE r;
     OMX_PARAM_PORTDEFINITIONTYPE portdef;
     OMX_INIT_STRUCTURE(portdef);
     portdef.nPortIndex = nPortIndex;
-    OMX_U32 i = 0;
-    while(i++ == 0 || portdef.bEnabled != bEnabled) {
-        if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
-            omx_die(r, "Failed to get port definition");
+    if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for %s", name);
+    }
+    plan->name = name;
+    plan->component = hComponent;
+    plan->port = nPortIndex;
+    plan->size = portdef.nBufferSize;
+    plan->count_min = portdef.nBufferCountMin;
+    plan->count_max = BUFFER_RING_SIZE;
+}
+
+// Fills in a buffer plan entry for a pool of unpacked frames, one frame
+// being unpacked and one being written at least
+static void init_frame_pool_plan(buffer_plan *plan, const char *name, size_t frame_size) {
+    plan->name = name;
+    plan->size = frame_size;
+    plan->count_min = 2;
+    plan->count_max = BUFFER_RING_SIZE;
+}
+
+// Shares the memory budget out among the pools. Each pool gets its minimum
+// number of buffers first, then the rest is handed out one buffer at a time
+// to each pool in turn. The buffer counts of the ports are set to the plan.
+static void plan_buffers(buffer_plan *plan, int plan_count, size_t budget) {
+    OMX_ERRORTYPE r;
+    OMX_PARAM_PORTDEFINITIONTYPE portdef;
+    size_t used = 0;
+    int i, added;
+    for(i = 0; i < plan_count; i++) {
+        plan[i].count = plan[i].count_min;
+        used += plan[i].size * plan[i].count;
+    }
+    if(used > budget) {
+        die("Memory budget of %zu bytes doesn't cover the %zu bytes of the minimum buffer counts", budget, used);
+    }
+    do {
+        added = 0;
+        for(i = 0; i < plan_count; i++) {
+            if(plan[i].count < plan[i].count_max && used + plan[i].size <= budget) {
+                plan[i].count++;
+                used += plan[i].size;
+                added = 1;
+            }
         }
-        if(portdef.bEnabled != bEnabled) {
-            usleep(10000);
+    } while(added);
+    say("Buffer plan for memory budget of %zu bytes:", budget);
+    for(i = 0; i < plan_count; i++) {
+        say("\t%s: %d buffers of %zu bytes, %zu bytes (%d .. %d buffers)",
+            plan[i].name, plan[i].count, plan[i].size, plan[i].size * plan[i].count, plan[i].count_min, plan[i].count_max);
+        if(!plan[i].component) {
+            continue;
         }
+        OMX_INIT_STRUCTURE(portdef);
+        portdef.nPortIndex = plan[i].port;
+        if((r = OMX_GetParameter(plan[i].component, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to get port definition for %s", plan[i].name);
+        }
+        portdef.nBufferCountActual = plan[i].count;
+        if((r = OMX_SetParameter(plan[i].component, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to set buffer count for %s", plan[i].name);
+        }
+    }
+    say("\tTotal %zu bytes, %zu bytes left", used, budget - used);
+}
+
+// Called by the producer, i.e. an OMX callback
+static void buffer_ring_push(buffer_ring *ring, OMX_BUFFERHEADERTYPE *buffer) {
+    unsigned int head = ring->head;
+    if(head - ring->tail == BUFFER_RING_SIZE) {
+        die("Buffer ring is full");
+    }
+    ring->buffers[head % BUFFER_RING_SIZE] = buffer;
+    // Make sure the entry is written before it's published
+    __sync_synchronize();
+    ring->head = head + 1;
+}
+
+// Called by the consumer, i.e. the main loop, returns NULL if the ring is empty
+static OMX_BUFFERHEADERTYPE *buffer_ring_pop(buffer_ring *ring) {
+    unsigned int tail = ring->tail;
+    OMX_BUFFERHEADERTYPE *buffer;
+    if(tail == ring->head) {
+        return NULL;
+    }
+    // Make sure the entry is read only after seeing the new head,
+    // and read before the slot is handed back to the producer
+    __sync_synchronize();
+    buffer = ring->buffers[tail % BUFFER_RING_SIZE];
+    __sync_synchronize();
+    ring->tail = tail + 1;
+    return buffer;
+}
+
+// Clears the padding of the frame, the rest is overwritten by unpacking
+static void frame_pool_clear_padding(frame_pool *pool, unsigned char *frame) {
+    int i;
+    for(i = 0; i < pool->padding_count; i++) {
+        memset(frame + pool->padding_offset[i], 0, pool->padding_size[i]);
+        pool->bytes_cleared += pool->padding_size[i];
+    }
+}
+
+static void frame_pool_init(frame_pool *pool, int pool_size, const i420_frame_info *frame_info) {
+    int i;
+    pool->pool_size = pool_size;
+    pool->frame_size = frame_info->size;
+    pool->padding_count = get_i420_padding(frame_info, pool->padding_offset, pool->padding_size);
+    pool->memory      = alloc_frame_memory(pool->pool_size * pool->frame_size, &pool->mapped_size);
+    pool->free_frames = calloc(pool->pool_size, sizeof(unsigned char*));
+    pool->refs        = calloc(pool->pool_size, sizeof(int));
+    if(!pool->memory || !pool->free_frames || !pool->refs) {
+        die("Failed to allocate frame pool of %d frames", pool->pool_size);
+    }
+    pool->frames_allocated = pool->pool_size;
+    // Hand out the frames in order
+    for(i = pool->pool_size - 1; i >= 0; i--) {
+        pool->free_frames[pool->free_count++] = pool->memory + i * pool->frame_size;
+        frame_pool_clear_padding(pool, pool->memory + i * pool->frame_size);
+    }
+    if(pthread_mutex_init(&pool->lock, NULL) != 0) {
+        die("Failed to create frame pool lock");
+    }
+}
+
+// Returns a frame with one reference to unpack to, or NULL if all the frames
+// are in use. Never blocks so that the camera isn't starved.
+static unsigned char *frame_pool_get(frame_pool *pool) {
+    unsigned char *frame = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if(pool->free_count > 0) {
+        frame = pool->free_frames[--pool->free_count];
+        pool->refs[(frame - pool->memory) / pool->frame_size] = 1;
+        pool->frames_acquired++;
+    } else {
+        pool->frames_dropped++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return frame;
+}
+
+static void frame_pool_ref(frame_pool *pool, unsigned char *frame) {
+    __sync_add_and_fetch(&pool->refs[(frame - pool->memory) / pool->frame_size], 1);
+}
+
+// Drops a reference, the frame is recycled when the last one is gone
+static void frame_pool_unref(frame_pool *pool, unsigned char *frame) {
+    if(__sync_sub_and_fetch(&pool->refs[(frame - pool->memory) / pool->frame_size], 1) > 0) {
+        return;
     }
+    pthread_mutex_lock(&pool->lock);
+    frame_pool_clear_padding(pool, frame);
+    pool->free_frames[pool->free_count++] = frame;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void frame_pool_destroy(frame_pool *pool) {
+    pthread_mutex_destroy(&pool->lock);
+    free((void*)pool->refs);
+    free(pool->free_frames);
+    free_frame_memory(pool->memory, pool->mapped_size);
 }
 
-static void block_until_flushed(appctx *ctx) {
-    int quit;
-    while(!quit) {
-        vcos_semaphore_wait(&ctx->handler_lock);
-        if(ctx->flushed) {
-            ctx->flushed = 0;
-            quit = 1;
+static void dump_frame_pool_stats(const char *message, const frame_pool *pool) {
+    say("%s statistics:\n"
+        "\tFrames allocated:\t%d of %d bytes\n"
+        "\tFrames acquired:\t%d\n"
+        "\tFrames dropped:\t\t%d\n"
+        "\tPadding cleared:\t%llu bytes, %llu bytes per frame\n",
+            message, pool->frames_allocated, pool->frame_size,
+            pool->frames_acquired, pool->frames_dropped,
+            pool->bytes_cleared, pool->frames_acquired ? pool->bytes_cleared / pool->frames_acquired : 0);
+}
+
+// Writes out the queued frames until frame_writer_stop() is called
+// and all the queued frames have been written
+static void *frame_writer_thread(void *arg) {
+    frame_writer *writer = (frame_writer*)arg;
+    unsigned long long write_start_ns, write_ns;
+    unsigned char *frame;
+    size_t written;
+    set_thread_scheduling("writer", WRITER_THREAD_POLICY, WRITER_THREAD_PRIORITY, WRITER_THREAD_CPU);
+    pthread_mutex_lock(&writer->lock);
+    while(1) {
+        while(writer->full_count == 0 && !writer->done) {
+            pthread_cond_wait(&writer->frame_available, &writer->lock);
         }
-        vcos_semaphore_post(&ctx->handler_lock);
-        if(!quit) {
-            usleep(10000);
+        if(writer->full_count == 0) {
+            break;
         }
+        frame = writer->full_frames[writer->full_first];
+        writer->full_first = (writer->full_first + 1) % writer->pool->pool_size;
+        writer->full_count--;
+        pthread_mutex_unlock(&writer->lock);
+        write_start_ns = get_time_ns();
+        written = fwrite(frame, 1, writer->pool->frame_size, writer->fd);
+        write_ns = get_time_ns() - write_start_ns;
+        if(written != writer->pool->frame_size) {
+            die("Failed to write to output file: Requested to write %d bytes, but only %d bytes written: %s",
+                writer->pool->frame_size, written, strerror(errno));
+        }
+        frame_pool_unref(writer->pool, frame);
+        pthread_mutex_lock(&writer->lock);
+        writer->frames_written++;
+        if(write_ns > writer->write_stall_max_ns) {
+            writer->write_stall_max_ns = write_ns;
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+static void frame_writer_start(frame_writer *writer, FILE *fd, frame_pool *pool) {
+    writer->pool = pool;
+    writer->fd = fd;
+    // Never more frames queued than there are in the pool
+    writer->full_frames = calloc(pool->pool_size, sizeof(unsigned char*));
+    if(!writer->full_frames) {
+        die("Failed to allocate writer queue");
+    }
+    if(pthread_mutex_init(&writer->lock, NULL) != 0 ||
+            pthread_cond_init(&writer->frame_available, NULL) != 0) {
+        die("Failed to create writer lock");
+    }
+    if(pthread_create(&writer->thread, NULL, frame_writer_thread, writer) != 0) {
+        die("Failed to create writer thread");
+    }
+}
+
+// Queues the frame to be written, the writer takes a reference of its own
+static void frame_writer_queue(frame_writer *writer, unsigned char *frame) {
+    frame_pool_ref(writer->pool, frame);
+    pthread_mutex_lock(&writer->lock);
+    writer->full_frames[(writer->full_first + writer->full_count) % writer->pool->pool_size] = frame;
+    writer->full_count++;
+    if(writer->full_count > writer->full_count_max) {
+        writer->full_count_max = writer->full_count;
+    }
+    pthread_cond_signal(&writer->frame_available);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Wait until the writer thread has written all the queued frames
+static void frame_writer_stop(frame_writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->done = 1;
+    pthread_cond_signal(&writer->frame_available);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    pthread_cond_destroy(&writer->frame_available);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->full_frames);
+}
+
+static void dump_writer_stats(const char *message, const frame_writer *writer) {
+    say("%s statistics:\n"
+        "\tFrames written:\t\t%d\n"
+        "\tMax frames queued:\t%d of %d\n"
+        "\tLongest write:\t\t%.1f ms\n",
+            message, writer->frames_written,
+            writer->full_count_max, writer->pool->pool_size,
+            writer->write_stall_max_ns / 1e6);
+}
+
+// Returns 1 if the frames can be unpacked straight to the output file
+static int output_map_open(output_map *map, FILE *fd, size_t frame_size) {
+    struct stat st;
+    if(!SCATTER_OUTPUT || fstat(fileno(fd), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return 0;
+    }
+    // Keep what is already in the file, e.g. when appending
+    map->base_offset = (fcntl(fileno(fd), F_GETFL) & O_APPEND) ? st.st_size : lseek(fileno(fd), 0, SEEK_CUR);
+    if(map->base_offset < 0) {
+        return 0;
+    }
+    // Mapping the file for writing needs it opened for reading too,
+    // which stdout redirected by the shell isn't
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(fd));
+    map->fd = open(path, O_RDWR);
+    if(map->fd < 0) {
+        say("Failed to reopen output file for mapping, writing it instead: %s", strerror(errno));
+        return 0;
+    }
+    map->frame_size = frame_size;
+    return 1;
+}
+
+static void output_map_release(output_map *map) {
+    if(map->map) {
+        // Start writing back the frames, nothing waits for it
+        msync(map->map, map->map_len, MS_ASYNC);
+        munmap(map->map, map->map_len);
+        map->map = NULL;
     }
 }
 
+// Returns where in the mapped output file to unpack frame number frame_index,
+// counted from 0. The next frames are preallocated and mapped when needed.
+static unsigned char *output_map_frame(output_map *map, int frame_index) {
+    unsigned long long start_ns;
+    off_t offset, end;
+    long page_size;
+    int r;
+    if(!map->map || frame_index < map->map_first_frame || frame_index >= map->map_first_frame + map->map_frames) {
+        start_ns = get_time_ns();
+        output_map_release(map);
+        page_size = sysconf(_SC_PAGESIZE);
+        map->map_first_frame = frame_index;
+        map->map_frames = OUTPUT_MAP_FRAMES;
+        offset = map->base_offset + (off_t)frame_index * map->frame_size;
+        end = offset + (off_t)map->map_frames * map->frame_size;
+        // Offset of the mapping must be a multiple of the page size
+        map->map_offset = offset & ~((off_t)page_size - 1);
+        map->map_len = end - map->map_offset;
+        r = fallocate(map->fd, 0, map->map_offset, map->map_len);
+        if(r != 0 && (errno == EOPNOTSUPP || errno == ENOSYS)) {
+            // The file system can't preallocate, just extend the file
+            r = ftruncate(map->fd, end);
+        }
+        if(r != 0) {
+            die("Failed to preallocate %zu bytes of output file: %s", map->map_len, strerror(errno));
+        }
+        map->map = mmap(NULL, map->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, map->map_offset);
+        if(map->map == MAP_FAILED) {
+            die("Failed to map %zu bytes of output file: %s", map->map_len, strerror(errno));
+        }
+        map->maps++;
+        if(get_time_ns() - start_ns > map->remap_max_ns) {
+            map->remap_max_ns = get_time_ns() - start_ns;
+        }
+    }
+    return map->map + (map->base_offset + (off_t)frame_index * map->frame_size - map->map_offset);
+}
+
+// Cuts the preallocated space beyond the last complete frame off the file
+static void output_map_close(output_map *map) {
+    output_map_release(map);
+    if(ftruncate(map->fd, map->base_offset + (off_t)map->frames_written * map->frame_size) != 0) {
+        die("Failed to truncate output file: %s", strerror(errno));
+    }
+    close(map->fd);
+}
+
+static void dump_output_map_stats(const output_map *map) {
+    say("Output file statistics:\n"
+        "\tFrames written:\t\t%d\n"
+        "\tMappings:\t\t%d of %d frames\n"
+        "\tLongest remap:\t\t%.1f ms\n",
+            map->frames_written, map->maps, OUTPUT_MAP_FRAMES,
+            map->remap_max_ns / 1e6);
+}
+
+// Convert a timeout relative to now to an absolute
+// CLOCK_MONOTONIC deadline for pthread_cond_timedwait()
+static void get_deadline(int timeout_ms, struct timespec *deadline) {
+    unsigned long long deadline_ns = get_time_ns() + timeout_ms * 1000000ULL;
+    deadline->tv_sec  = deadline_ns / 1000000000ULL;
+    deadline->tv_nsec = deadline_ns % 1000000000ULL;
+}
+
+// Wait until the event handler has received OMX_EventCmdComplete
+// for the given command, returns -1 if timeout_ms elapsed before that
+static int wait_for_command_complete(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2, int timeout_ms) {
+    struct timespec deadline;
+    int i, found = 0, timed_out = 0;
+    get_deadline(timeout_ms, &deadline);
+    pthread_mutex_lock(&ctx->command_lock);
+    while(1) {
+        for(i = 0; i < ctx->command_events_count; i++) {
+            omx_command_event *e = &ctx->command_events[i];
+            if(e->hComponent == hComponent && e->nCommand == nCommand && e->nData2 == nData2) {
+                // Consume the event so that it won't satisfy a later wait
+                *e = ctx->command_events[--ctx->command_events_count];
+                found = 1;
+                break;
+            }
+        }
+        if(found || timed_out) {
+            break;
+        }
+        timed_out = pthread_cond_timedwait(&ctx->command_cond, &ctx->command_lock, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&ctx->command_lock);
+    return found ? 0 : -1;
+}
+
+// Some blocking waits to verify we're running in order
+static void block_until_port_changed(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled, int timeout_ms) {
+    OMX_COMMANDTYPE nCommand = bEnabled ? OMX_CommandPortEnable : OMX_CommandPortDisable;
+    if(wait_for_command_complete(ctx, hComponent, nCommand, nPortIndex, timeout_ms) != 0) {
+        die("Timed out after %d ms waiting for port %d of component 0x%08x to be %s",
+            timeout_ms, nPortIndex, hComponent, bEnabled ? "enabled" : "disabled");
+    }
+}
+
+// Milliseconds left until the deadline, 0 if it has already passed
+static int get_remaining_ms(unsigned long long deadline_ns) {
+    unsigned long long now_ns = get_time_ns();
+    return now_ns < deadline_ns ? (deadline_ns - now_ns + 999999ULL) / 1000000ULL : 0;
+}
+
+// Wait for all the pending commands at once. They are carried out
+// concurrently by the components, so they share a single deadline.
+static void block_until_commands_complete(appctx *ctx, int timeout_ms) {
+    unsigned long long deadline_ns = get_time_ns() + timeout_ms * 1000000ULL;
+    int i;
+    for(i = 0; i < ctx->pending_commands_count; i++) {
+        omx_command_event *e = &ctx->pending_commands[i];
+        if(wait_for_command_complete(ctx, e->hComponent, e->nCommand, e->nData2, get_remaining_ms(deadline_ns)) != 0) {
+            die("Timed out after %d ms waiting for component 0x%08x to complete command %d for %d",
+                timeout_ms, e->hComponent, e->nCommand, e->nData2);
+        }
+    }
+    ctx->pending_commands_count = 0;
+}
+
+// Remember a command sent to a component so that it can be waited for
+// together with the others by block_until_commands_complete()
+static void add_pending_command(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2) {
+    if(ctx->pending_commands_count == MAX_PENDING_COMMANDS) {
+        die("Too many pending commands");
+    }
+    omx_command_event *e = &ctx->pending_commands[ctx->pending_commands_count++];
+    e->hComponent = hComponent;
+    e->nCommand = nCommand;
+    e->nData2 = nData2;
+}
+
+// Same for a startup command, which is waited for
+// right away without CONCURRENT_BRINGUP
+static void expect_command_complete(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2) {
+    add_pending_command(ctx, hComponent, nCommand, nData2);
+    if(!CONCURRENT_BRINGUP) {
+        block_until_commands_complete(ctx, OMX_COMMAND_TIMEOUT);
+    }
+}
+
+// Log the time spent in a startup or teardown phase and start timing the next one
+static void end_phase(unsigned long long *phase_start_ns, const char *sequence, const char *phase) {
+    unsigned long long now_ns = get_time_ns();
+    say("%s phase %s took %.1f ms", sequence, phase, (now_ns - *phase_start_ns) / 1e6);
+    *phase_start_ns = now_ns;
+}
+
+static void block_until_camera_ready(appctx *ctx, int timeout_ms) {
+    struct timespec deadline;
+    int timed_out = 0;
+    get_deadline(timeout_ms, &deadline);
+    pthread_mutex_lock(&ctx->command_lock);
+    while(!ctx->camera_ready && !timed_out) {
+        timed_out = pthread_cond_timedwait(&ctx->command_cond, &ctx->command_lock, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&ctx->command_lock);
+    if(!ctx->camera_ready) {
+        die("Timed out after %d ms waiting for the camera to become ready", timeout_ms);
+    }
+}
+
+// Sleep until fill_output_buffer_done_handler() has passed
+// a filled buffer to us through the ring and take it
+static OMX_BUFFERHEADERTYPE *block_until_output_buffer_available(appctx *ctx) {
+    OMX_BUFFERHEADERTYPE *buffer;
+    while((buffer = buffer_ring_pop(&ctx->camera_output_buffers_filled)) == NULL) {
+        vcos_semaphore_wait(&ctx->camera_output_buffer_ready);
+    }
+    return buffer;
+}
+
 static void init_component_handle(
         const char *name,
         OMX_HANDLETYPE* hComponent,
@@ -462,7 +2493,7 @@ static void init_component_handle(
                 if((r = OMX_SendCommand(*hComponent, OMX_CommandPortDisable, nPortIndex, NULL)) != OMX_ErrorNone) {
                     omx_die(r, "Failed to disable port %d of component %s", nPortIndex, fullname);
                 }
-                block_until_port_changed(*hComponent, nPortIndex, OMX_FALSE);
+                expect_command_complete((appctx *)pAppData, *hComponent, OMX_CommandPortDisable, nPortIndex);
             }
         }
     }
@@ -481,6 +2512,7 @@ static OMX_ERRORTYPE event_handler(
         OMX_U32 nData1,
         OMX_U32 nData2,
         OMX_PTR pEventData) {
+    configure_callback_thread();
 
     dump_event(hComponent, eEvent, nData1, nData2);
 
@@ -488,18 +2520,25 @@ static OMX_ERRORTYPE event_handler(
 
     switch(eEvent) {
         case OMX_EventCmdComplete:
-            vcos_semaphore_wait(&ctx->handler_lock);
-            if(nData1 == OMX_CommandFlush) {
-                ctx->flushed = 1;
+            // Record the event for wait_for_command_complete()
+            pthread_mutex_lock(&ctx->command_lock);
+            if(ctx->command_events_count == MAX_COMMAND_EVENTS) {
+                die("Too many command complete events pending");
             }
-            vcos_semaphore_post(&ctx->handler_lock);
+            ctx->command_events[ctx->command_events_count].hComponent = hComponent;
+            ctx->command_events[ctx->command_events_count].nCommand   = nData1;
+            ctx->command_events[ctx->command_events_count].nData2     = nData2;
+            ctx->command_events_count++;
+            pthread_cond_broadcast(&ctx->command_cond);
+            pthread_mutex_unlock(&ctx->command_lock);
             break;
         case OMX_EventParamOrConfigChanged:
-            vcos_semaphore_wait(&ctx->handler_lock);
+            pthread_mutex_lock(&ctx->command_lock);
             if(nData2 == OMX_IndexParamCameraDeviceNumber) {
                 ctx->camera_ready = 1;
+                pthread_cond_broadcast(&ctx->command_cond);
             }
-            vcos_semaphore_post(&ctx->handler_lock);
+            pthread_mutex_unlock(&ctx->command_lock);
             break;
         case OMX_EventError:
             omx_die(nData1, "error event received");
@@ -517,18 +2556,28 @@ static OMX_ERRORTYPE fill_output_buffer_done_handler(
         OMX_HANDLETYPE hComponent,
         OMX_PTR pAppData,
         OMX_BUFFERHEADERTYPE* pBuffer) {
+    configure_callback_thread();
     appctx *ctx = ((appctx*)pAppData);
-    vcos_semaphore_wait(&ctx->handler_lock);
+    mark_buffer_dequeued(pBuffer);
     // The main loop can now flush the buffer to output file
-    ctx->camera_output_buffer_available = 1;
-    vcos_semaphore_post(&ctx->handler_lock);
+    buffer_ring_push(&ctx->camera_output_buffers_filled, pBuffer);
+    // Wake up the main loop
+    vcos_semaphore_post(&ctx->camera_output_buffer_ready);
     return OMX_ErrorNone;
 }
 
 int main(int argc, char **argv) {
+    unsigned long long startup_ns = get_time_ns(), phase_ns = startup_ns;
+
+    if(UNPACK_BENCHMARK) {
+        benchmark_unpack_kernels();
+        return 0;
+    }
+
     bcm_host_init();
 
     OMX_ERRORTYPE r;
+    int i;
 
     if((r = OMX_Init()) != OMX_ErrorNone) {
         omx_die(r, "OMX initalization failed");
@@ -537,18 +2586,28 @@ int main(int argc, char **argv) {
     // Init context
     appctx ctx;
     memset(&ctx, 0, sizeof(ctx));
-    if(vcos_semaphore_create(&ctx.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
-        die("Failed to create handler lock semaphore");
+    if(vcos_semaphore_create(&ctx.camera_output_buffer_ready, "camera_output_buffer_ready", 0) != VCOS_SUCCESS) {
+        die("Failed to create camera output buffer ready semaphore");
     }
+    pthread_condattr_t command_cond_attr;
+    pthread_condattr_init(&command_cond_attr);
+    pthread_condattr_setclock(&command_cond_attr, CLOCK_MONOTONIC);
+    if(pthread_mutex_init(&ctx.command_lock, NULL) != 0 || pthread_cond_init(&ctx.command_cond, &command_cond_attr) != 0) {
+        die("Failed to create command completion lock");
+    }
+    pthread_condattr_destroy(&command_cond_attr);
 
     // Init component handles
     OMX_CALLBACKTYPE callbacks;
-    memset(&ctx, 0, sizeof(callbacks));
+    memset(&callbacks, 0, sizeof(callbacks));
     callbacks.EventHandler   = event_handler;
     callbacks.FillBufferDone = fill_output_buffer_done_handler;
 
     init_component_handle("camera", &ctx.camera , &ctx, &callbacks);
     init_component_handle("null_sink", &ctx.null_sink, &ctx, &callbacks);
+    // Wait for the ports of all the components to be disabled at once
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "component handles");
 
     say("Configuring camera...");
 
@@ -602,6 +2661,11 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to get port definition for camera preview output port 70");
     }
     camera_portdef.nPortIndex = 71;
+    // Keep a pool of buffers queued with the camera so that it can carry
+    // on capturing while the main loop is unpacking the previous buffers
+    if(camera_portdef.nBufferCountActual < CAMERA_OUTPUT_BUFFERS) {
+        camera_portdef.nBufferCountActual = CAMERA_OUTPUT_BUFFERS;
+    }
     if((r = OMX_SetParameter(ctx.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to set port definition for camera video output port 71");
     }
@@ -700,11 +2764,6 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to set mirror configuration for camera video output port 71");
     }
 
-    // Ensure camera is ready
-    while(!ctx.camera_ready) {
-        usleep(10000);
-    }
-
     say("Configuring null sink...");
 
     say("Default port definition for null sink input port 240");
@@ -712,42 +2771,122 @@ int main(int argc, char **argv) {
 
     // Null sink input port definition is done automatically upon tunneling
 
+    // Ensure camera is ready, it has been getting ready
+    // while the other components were configured
+    block_until_camera_ready(&ctx, OMX_COMMAND_TIMEOUT);
+
     // Tunnel camera preview output port and null sink input port
     say("Setting up tunnel from camera preview output port 70 to null sink input port 240...");
     if((r = OMX_SetupTunnel(ctx.camera, 70, ctx.null_sink, 240)) != OMX_ErrorNone) {
         omx_die(r, "Failed to setup tunnel between camera preview output port 70 and null sink input port 240");
     }
 
+    // Sizes of the frames of each output. The reduced copy and the regions
+    // of interest aren't rotated.
+    i420_frame_info plan_frame_info;
+    OMX_INIT_STRUCTURE(camera_portdef);
+    camera_portdef.nPortIndex = 71;
+    if((r = OMX_GetParameter(ctx.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for camera video output port 71");
+    }
+    get_output_frame_info(OUTPUT_FORMAT, camera_portdef.format.image.nFrameWidth, camera_portdef.format.image.nFrameHeight, OUTPUT_ALIGNMENT, camera_portdef.format.image.nStride, camera_portdef.format.video.nSliceHeight, &plan_frame_info);
+    rotate_frame_info(&plan_frame_info, OUTPUT_ROTATION, OUTPUT_ALIGNMENT);
+    int source_width = camera_portdef.format.image.nFrameWidth, source_height = camera_portdef.format.image.nFrameHeight;
+    int downscale_factor = DOWNSCALE_FACTOR;
+    i420_frame_info reduced_info;
+    if(downscale_factor) {
+        get_i420_frame_info(source_width / downscale_factor, source_height / downscale_factor, 1, -1, -1, &reduced_info);
+    }
+    int roi_count = REGION_OF_INTEREST_COUNT;
+    roi_output *rois = calloc(roi_count ? roi_count : 1, sizeof(roi_output));
+    if(!rois) {
+        die("Failed to allocate regions of interest");
+    }
+    for(i = 0; i < roi_count; i++) {
+        rois[i].region = regions_of_interest[i];
+        if(!clip_region_of_interest(&rois[i].region, source_width, source_height)) {
+            die("Region of interest %d is outside the %dx%d frame", i, source_width, source_height);
+        }
+        get_i420_frame_info(rois[i].region.width, rois[i].region.height, 1, -1, -1, &rois[i].frame_info);
+    }
+
+    // Where to unpack the fragmented Y, U, and V plane spans from the OMX
+    // buffers: frames written out by the writer thread, or their place in
+    // the output file itself if it's a regular file. Just use stdout for output.
+    say("Opening output file...");
+    ctx.fd_out = stdout;
+    int full_frame_output = FULL_FRAME_OUTPUT;
+    ctx.scatter_output = full_frame_output && output_map_open(&ctx.output, ctx.fd_out, plan_frame_info.size);
+
+    // Size the camera buffers and the frame pools to fit in the memory budget,
+    // there is no full frame pool when unpacking straight to the output file
+    ctx.frame_pool_size = FRAME_POOL_SIZE;
+    ctx.reduced_pool_size = FRAME_POOL_SIZE;
+    for(i = 0; i < roi_count; i++) {
+        rois[i].pool_size = FRAME_POOL_SIZE;
+    }
+    if(MEMORY_BUDGET) {
+        buffer_plan *plan = calloc(3 + roi_count, sizeof(buffer_plan));
+        int plan_count = 1, frame_plan = -1, reduced_plan = -1, roi_plan;
+        if(!plan) {
+            die("Failed to allocate buffer plan");
+        }
+        init_port_plan(&plan[0], "camera video output port 71", ctx.camera, 71);
+        if(full_frame_output && !ctx.scatter_output) {
+            frame_plan = plan_count++;
+            init_frame_pool_plan(&plan[frame_plan], "frame pool", plan_frame_info.size);
+        }
+        if(downscale_factor) {
+            reduced_plan = plan_count++;
+            init_frame_pool_plan(&plan[reduced_plan], "reduced frame pool", reduced_info.size);
+        }
+        roi_plan = plan_count;
+        for(i = 0; i < roi_count; i++) {
+            init_frame_pool_plan(&plan[plan_count++], rois[i].region.file, rois[i].frame_info.size);
+        }
+        plan_buffers(plan, plan_count, MEMORY_BUDGET * 1024ULL * 1024ULL);
+        if(frame_plan >= 0) {
+            ctx.frame_pool_size = plan[frame_plan].count;
+        }
+        if(reduced_plan >= 0) {
+            ctx.reduced_pool_size = plan[reduced_plan].count;
+        }
+        for(i = 0; i < roi_count; i++) {
+            rois[i].pool_size = plan[roi_plan + i].count;
+        }
+        free(plan);
+    }
+
+    end_phase(&phase_ns, "Startup", "configuration");
+
     // Switch components to idle state
     say("Switching state of the camera component to idle...");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to idle");
     }
-    block_until_state_changed(ctx.camera, OMX_StateIdle);
+    expect_command_complete(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateIdle);
     say("Switching state of the null sink component to idle...");
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to idle");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
+    expect_command_complete(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle);
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "idle");
 
     // Enable ports
     say("Enabling ports...");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera input port 73");
     }
-    block_until_port_changed(ctx.camera, 73, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera preview output port 70");
     }
-    block_until_port_changed(ctx.camera, 70, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera video output port 71");
     }
-    block_until_port_changed(ctx.camera, 71, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortEnable, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable null sink input port 240");
     }
-    block_until_port_changed(ctx.null_sink, 240, OMX_TRUE);
 
     // Allocate camera input and video output buffers,
     // buffers for tunneled ports are allocated internally by OMX
@@ -764,13 +2903,28 @@ int main(int argc, char **argv) {
     if((r = OMX_GetParameter(ctx.camera, OMX_IndexParamPortDefinition, &camera_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for camera vіdeo output port 71");
     }
-    if((r = OMX_AllocateBuffer(ctx.camera, &ctx.camera_ppBuffer_out, 71, NULL, camera_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for camera video output port 71");
+    ctx.camera_output_buffer_count = camera_portdef.nBufferCountActual;
+    if(ctx.camera_output_buffer_count > BUFFER_RING_SIZE) {
+        die("Camera output buffer pool of %d buffers doesn't fit in the buffer ring", ctx.camera_output_buffer_count);
+    }
+    ctx.camera_ppBuffer_out = calloc(ctx.camera_output_buffer_count, sizeof(OMX_BUFFERHEADERTYPE*));
+    if(!ctx.camera_ppBuffer_out) {
+        die("Failed to allocate camera output buffer pool of %d buffers", ctx.camera_output_buffer_count);
+    }
+    ctx.camera_output_buffer_meta = alloc_buffer_meta(ctx.camera_output_buffer_count);
+    for(i = 0; i < ctx.camera_output_buffer_count; i++) {
+        if((r = OMX_AllocateBuffer(ctx.camera, &ctx.camera_ppBuffer_out[i], 71, &ctx.camera_output_buffer_meta[i], camera_portdef.nBufferSize)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to allocate buffer %d for camera video output port 71", i);
+        }
     }
+    say("Allocated %d buffers of %d bytes for camera video output port 71", ctx.camera_output_buffer_count, camera_portdef.nBufferSize);
 
-    // Just use stdout for output
-    say("Opening input and output files...");
-    ctx.fd_out = stdout;
+    // Enabling a port completes only once it has been populated with buffers
+    block_until_port_changed(&ctx, ctx.camera, 73, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.camera, 70, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.camera, 71, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.null_sink, 240, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "port enable");
 
     // Switch state of the components prior to starting
     // the video capture loop
@@ -778,12 +2932,13 @@ int main(int argc, char **argv) {
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to executing");
     }
-    block_until_state_changed(ctx.camera, OMX_StateExecuting);
+    expect_command_complete(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateExecuting);
     say("Switching state of the null sink component to executing...");
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to executing");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateExecuting);
+    expect_command_complete(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateExecuting);
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
 
     // Start capturing video with the camera
     say("Switching on capture on camera video output port 71...");
@@ -795,6 +2950,8 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to switch on capture on camera video output port 71");
     }
 
+    end_phase(&phase_ns, "Startup", "executing");
+
     say("Configured port definition for camera input port 73");
     dump_port(ctx.camera, 73, OMX_FALSE);
     say("Configured port definition for camera preview output port 70");
@@ -805,142 +2962,290 @@ int main(int argc, char **argv) {
     dump_port(ctx.null_sink, 240, OMX_FALSE);
 
     i420_frame_info frame_info, buf_info;
-    get_i420_frame_info(camera_portdef.format.image.nFrameWidth, camera_portdef.format.image.nFrameHeight, camera_portdef.format.image.nStride, camera_portdef.format.video.nSliceHeight, &frame_info);
-    get_i420_frame_info(frame_info.buf_stride, frame_info.buf_slice_height, -1, -1, &buf_info);
+    get_output_frame_info(OUTPUT_FORMAT, camera_portdef.format.image.nFrameWidth, camera_portdef.format.image.nFrameHeight, OUTPUT_ALIGNMENT, camera_portdef.format.image.nStride, camera_portdef.format.video.nSliceHeight, &frame_info);
+    if(OUTPUT_ROTATION) {
+        if(OUTPUT_ROTATION != 90 && OUTPUT_ROTATION != 180 && OUTPUT_ROTATION != 270) {
+            die("Rotation by %d degrees isn't supported", OUTPUT_ROTATION);
+        }
+        if(frame_info.format != OUTPUT_FORMAT_I420 && frame_info.format != OUTPUT_FORMAT_Y) {
+            die("Rotating %s frames isn't supported", output_format_names[frame_info.format]);
+        }
+        rotate_frame_info(&frame_info, OUTPUT_ROTATION, OUTPUT_ALIGNMENT);
+        say("Rotating the frames by %d degrees clockwise", OUTPUT_ROTATION);
+    }
+    get_i420_frame_info(frame_info.buf_stride, frame_info.buf_slice_height, 4, -1, -1, &buf_info);
     dump_frame_info("Destination frame", &frame_info);
     dump_frame_info("Source buffer", &buf_info);
+    size_t frame_unpacked_size = get_i420_unpacked_size(&frame_info);
+    say("Writing %d bytes of %s per frame with rows aligned to %d bytes",
+        frame_info.size, output_format_names[frame_info.format], OUTPUT_ALIGNMENT);
+
+    if(ctx.scatter_output) {
+        say("Unpacking frames straight to the output file");
+    } else if(full_frame_output) {
+        frame_pool_init(&ctx.frames, ctx.frame_pool_size, &frame_info);
+        frame_writer_start(&ctx.writer, ctx.fd_out, &ctx.frames);
+    } else {
+        say("Not writing the full frames");
+    }
+
+    // The reduced copy is downscaled from the slices while unpacking them
+    // and written out by a writer thread of its own
+    unsigned char *reduced = NULL;
+    if(downscale_factor) {
+        if(frame_info.buf_slice_height % (2 * downscale_factor) != 0) {
+            die("Slice height %d isn't a multiple of twice the downscale factor %d",
+                frame_info.buf_slice_height, downscale_factor);
+        }
+        dump_frame_info("Reduced frame", &reduced_info);
+        if((ctx.fd_reduced = fopen(DOWNSCALE_OUTPUT, "wb")) == NULL) {
+            die("Failed to open %s for writing the reduced frames: %s", DOWNSCALE_OUTPUT, strerror(errno));
+        }
+        frame_pool_init(&ctx.reduced_frames, ctx.reduced_pool_size, &reduced_info);
+        frame_writer_start(&ctx.reduced_writer, ctx.fd_reduced, &ctx.reduced_frames);
+    }
 
-    // Buffer representing an I420 frame where to unpack
-    // the fragmented Y, U, and V plane spans from the OMX buffers
-    char *frame = calloc(1, frame_info.size);
-    if(frame == NULL) {
-        die("Failed to allocate frame buffer");
+    // The regions of interest are copied from the slices while unpacking
+    // them and written out by writer threads of their own
+    for(i = 0; i < roi_count; i++) {
+        say("Region of interest %d: %dx%d at %d,%d written to %s", i,
+            rois[i].region.width, rois[i].region.height, rois[i].region.x, rois[i].region.y, rois[i].region.file);
+        if((rois[i].fd = fopen(rois[i].region.file, "wb")) == NULL) {
+            die("Failed to open %s for writing region of interest %d: %s", rois[i].region.file, i, strerror(errno));
+        }
+        frame_pool_init(&rois[i].frames, rois[i].pool_size, &rois[i].frame_info);
+        frame_writer_start(&rois[i].writer, rois[i].fd, &rois[i].frames);
     }
+    unsigned char *frame = NULL;
 
     // Some counters
     int frame_num = 1, buf_num = 0;
-    size_t output_written, frame_bytes = 0, buf_size, buf_bytes_read = 0, buf_bytes_copied;
-    int i;
+    size_t frame_bytes = 0, buf_size, buf_bytes_read = 0, buf_bytes_copied;
     // I420 spec: U and V plane span size half of the size of the Y plane span size
-    int max_spans_y = buf_info.height, max_spans_uv = max_spans_y / 2;
+    int max_spans_y = buf_info.height;
     int valid_spans_y, valid_spans_uv;
     // For unpack memory copy operation
     unsigned char *buf_start;
-    int max_spans, valid_spans;
-    int dst_offset, src_offset, span_size;
+    const unpack_kernel *kernel = select_unpack_kernel();
+    say("Unpacking with the %s kernel", kernel->name);
+    const fixed_layout *layout = (FIXED_LAYOUTS ? select_fixed_layout(&frame_info, &buf_info) : NULL);
+    if(layout) {
+        say("Unpacking with the fixed %s layout", layout->name);
+    }
+    downscale_row_fn downscale_row = (DOWNSCALE_FILTER == DOWNSCALE_BILINEAR ? kernel->downscale_bilinear : kernel->downscale_box);
+    if(downscale_factor) {
+        say("Downscaling %dx with the %s filter to %s", downscale_factor, downscale_filter_names[DOWNSCALE_FILTER], DOWNSCALE_OUTPUT);
+    }
     // For controlling the loop
-    int quit_detected = 0, quit_in_frame_boundry = 0, need_next_buffer_to_be_filled = 1;
+    int quit_detected = 0, quit_in_frame_boundry = 0;
+    OMX_BUFFERHEADERTYPE *buffer;
+
+    // Queue all the buffers with the camera up front
+    for(i = 0; i < ctx.camera_output_buffer_count; i++) {
+        mark_buffer_enqueued(ctx.camera_ppBuffer_out[i]);
+        if((r = OMX_FillThisBuffer(ctx.camera, ctx.camera_ppBuffer_out[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer %d on camera video output port 71", i);
+        }
+    }
+
+    set_thread_scheduling("main", MAIN_THREAD_POLICY, MAIN_THREAD_PRIORITY, MAIN_THREAD_CPU);
+    jitter_stats jitter;
+    memset(&jitter, 0, sizeof(jitter));
+    long minor_faults_start, major_faults_start, minor_faults, major_faults;
+    get_page_faults(&minor_faults_start, &major_faults_start);
 
     say("Enter capture loop, press Ctrl-C to quit...");
+    unsigned long long capture_start_ns = get_time_ns(), capture_ns;
 
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGQUIT, signal_handler);
 
     while(1) {
-        // fill_output_buffer_done_handler() has marked that there's
-        // a buffer for us to flush
-        if(ctx.camera_output_buffer_available) {
-            // Print a message if the user wants to quit, but don't exit
-            // the loop until we are certain that we have processed
-            // a full frame till end of the frame. This way we should always
-            // avoid corruption of the last encoded at the expense of
-            // small delay in exiting.
-            if(want_quit && !quit_detected) {
-                say("Exit signal detected, waiting for next frame boundry before exiting...");
-                quit_detected = 1;
-                quit_in_frame_boundry = ctx.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
+        // Sleep until fill_output_buffer_done_handler() signals
+        // that there's a buffer for us to flush
+        buffer = block_until_output_buffer_available(&ctx);
+        // Print a message if the user wants to quit, but don't exit
+        // the loop until we are certain that we have processed
+        // a full frame till end of the frame. This way we should always
+        // avoid corruption of the last encoded at the expense of
+        // small delay in exiting.
+        if(want_quit && !quit_detected) {
+            say("Exit signal detected, waiting for next frame boundry before exiting...");
+            quit_detected = 1;
+            quit_in_frame_boundry = buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME;
+        }
+        if(quit_detected &&
+                (quit_in_frame_boundry ^
+                (buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME))) {
+            say("Frame boundry reached, exiting loop...");
+            break;
+        }
+        // Take a free frame at the start of each frame, if the writer
+        // thread has all of them the frame is dropped instead of blocking
+        if(buf_num == 0) {
+            if(ctx.scatter_output) {
+                frame = output_map_frame(&ctx.output, ctx.output.frames_written);
+            } else if(full_frame_output) {
+                frame = frame_pool_get(&ctx.frames);
             }
-            if(quit_detected &&
-                    (quit_in_frame_boundry ^
-                    (ctx.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME))) {
-                say("Frame boundry reached, exiting loop...");
-                break;
+            if(downscale_factor) {
+                reduced = frame_pool_get(&ctx.reduced_frames);
+            }
+            for(i = 0; i < roi_count; i++) {
+                rois[i].frame = frame_pool_get(&rois[i].frames);
             }
-            // Start of the OMX buffer data
-            buf_start = ctx.camera_ppBuffer_out->pBuffer
-                + ctx.camera_ppBuffer_out->nOffset;
-            // Size of the OMX buffer data;
-            buf_size = ctx.camera_ppBuffer_out->nFilledLen;
-            buf_bytes_read += buf_size;
-            buf_bytes_copied = 0;
-            // Detect the possibly non-full buffer in the last buffer of a frame
-            valid_spans_y = max_spans_y
-                - ((ctx.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME)
-                    ? frame_info.buf_extra_padding
-                    : 0);
-            // I420 spec: U and V plane span size half of the size of the Y plane span size
-            valid_spans_uv = valid_spans_y / 2;
-            // Unpack Y, U, and V plane spans from the buffer to the I420 frame
-            for(i = 0; i < 3; i++) {
-                // Number of maximum and valid spans for this plane
-                max_spans   = (i == 0 ? max_spans_y   : max_spans_uv);
-                valid_spans = (i == 0 ? valid_spans_y : valid_spans_uv);
-                dst_offset =
-                    // Start of the plane span in the I420 frame
-                    frame_info.p_offset[i] +
-                    // Plane spans copied from the previous buffers
-                    (buf_num * frame_info.p_stride[i] * max_spans);
-                src_offset =
-                    // Start of the plane span in the buffer
-                    buf_info.p_offset[i];
-                span_size =
-                    // Plane span size multiplied by the available spans in the buffer
-                    frame_info.p_stride[i] * valid_spans;
-                memcpy(
-                    // Destination starts from the beginning of the frame and move forward by offset
-                    frame + dst_offset,
-                    // Source starts from the beginning of the OMX component buffer and move forward by offset
-                    buf_start + src_offset,
-                    // The final plane span size, possible padding at the end of
-                    // the plane span section in the buffer isn't included
-                    // since the size is based on the final frame plane span size
-                    span_size);
-                buf_bytes_copied += span_size;
+        }
+        // Start of the OMX buffer data
+        buf_start = buffer->pBuffer
+            + buffer->nOffset;
+        // Size of the OMX buffer data;
+        buf_size = buffer->nFilledLen;
+        buf_bytes_read += buf_size;
+        // Detect the possibly non-full buffer in the last buffer of a frame
+        valid_spans_y = max_spans_y
+            - ((buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME)
+                ? frame_info.buf_extra_padding
+                : 0);
+        // I420 spec: U and V plane span size half of the size of the Y plane span size
+        valid_spans_uv = (valid_spans_y + 1) / 2;
+        // Unpack Y, U, and V plane spans from the buffer to the output frame
+        buf_bytes_copied = (layout
+            ? layout->unpack_slice(kernel, frame, buf_start, buf_num, valid_spans_y)
+            : unpack_slice(kernel, frame, &frame_info, buf_start, &buf_info, buf_num, valid_spans_y));
+        frame_bytes += buf_bytes_copied;
+        if(reduced) {
+            downscale_slice(downscale_row, downscale_factor, reduced, &reduced_info, buf_start, &buf_info, source_width, buf_num, valid_spans_y);
+        }
+        for(i = 0; i < roi_count; i++) {
+            if(rois[i].frame) {
+                unpack_roi_slice(kernel, &rois[i], buf_start, &buf_info, buf_num, valid_spans_y);
+            }
+        }
+        BUFFER_META(buffer)->frame_index = frame_num;
+        BUFFER_META(buffer)->slice_index = buf_num;
+        buf_num++;
+        say("Read %d bytes from buffer %d of frame %d, copied %d bytes from %d Y spans and %d U/V spans available, port buffer %d, timestamp %lld us, %.1f ms with the camera, %.1f ms waiting to be unpacked",
+            buf_size, buf_num, frame_num, buf_bytes_copied, valid_spans_y, valid_spans_uv,
+            BUFFER_META(buffer)->buffer_index, get_timestamp_us(BUFFER_META(buffer)->timestamp),
+            (BUFFER_META(buffer)->dequeue_ns - BUFFER_META(buffer)->enqueue_ns) / 1e6,
+            (get_time_ns() - BUFFER_META(buffer)->dequeue_ns) / 1e6);
+        if(buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+            add_frame_arrival(&jitter);
+            if(frame_num == 1) {
+                say("Startup to first frame took %.1f ms", (get_time_ns() - startup_ns) / 1e6);
             }
-            frame_bytes += buf_bytes_copied;
-            buf_num++;
-            say("Read %d bytes from buffer %d of frame %d, copied %d bytes from %d Y spans and %d U/V spans available",
-                buf_size, buf_num, frame_num, buf_bytes_copied, valid_spans_y, valid_spans_uv);
-            if(ctx.camera_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
-                // Dump the complete I420 frame
-                say("Captured frame %d, %d packed bytes read, %d bytes unpacked, writing %d unpacked frame bytes",
+            if(frame_bytes != frame_unpacked_size) {
+                die("Frame bytes read %d doesn't match the unpacked frame size %d",
+                    frame_bytes, frame_unpacked_size);
+            }
+            if(ctx.scatter_output) {
+                // The frame is already in its place in the output file
+                say("Captured frame %d, %d packed bytes read, %d bytes unpacked to the output file",
+                    frame_num, buf_bytes_read, frame_bytes);
+                ctx.output.frames_written++;
+                frame = NULL;
+            } else if(frame) {
+                // Hand the complete frame to the writer thread
+                say("Captured frame %d, %d packed bytes read, %d bytes unpacked, queuing %d unpacked frame bytes",
                     frame_num, buf_bytes_read, frame_bytes, frame_info.size);
-                if(frame_bytes != frame_info.size) {
-                    die("Frame bytes read %d doesn't match the frame size %d",
-                        frame_bytes, frame_info.size);
-                }
-                output_written = fwrite(frame, 1, frame_info.size, ctx.fd_out);
-                if(output_written != frame_info.size) {
-                    die("Failed to write to output file: Requested to write %d bytes, but only %d bytes written: %s",
-                        frame_info.size, output_written, strerror(errno));
-                }
-                frame_num++;
-                buf_num = 0;
-                buf_bytes_read = 0;
-                frame_bytes = 0;
-                memset(frame, 0, frame_info.size);
+                frame_writer_queue(&ctx.writer, frame);
+                frame_pool_unref(&ctx.frames, frame);
+                frame = NULL;
+            } else if(full_frame_output) {
+                say("Dropped frame %d, the writer thread is falling behind", frame_num);
             }
-            need_next_buffer_to_be_filled = 1;
-        }
-        // Buffer flushed, request a new buffer to be filled by the camera component
-        if(need_next_buffer_to_be_filled) {
-            need_next_buffer_to_be_filled = 0;
-            ctx.camera_output_buffer_available = 0;
-            if((r = OMX_FillThisBuffer(ctx.camera, ctx.camera_ppBuffer_out)) != OMX_ErrorNone) {
-                omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
+            if(reduced) {
+                frame_writer_queue(&ctx.reduced_writer, reduced);
+                frame_pool_unref(&ctx.reduced_frames, reduced);
+                reduced = NULL;
+            } else if(downscale_factor) {
+                say("Dropped reduced frame %d, the writer thread is falling behind", frame_num);
             }
+            for(i = 0; i < roi_count; i++) {
+                if(rois[i].frame) {
+                    frame_writer_queue(&rois[i].writer, rois[i].frame);
+                    frame_pool_unref(&rois[i].frames, rois[i].frame);
+                    rois[i].frame = NULL;
+                } else {
+                    say("Dropped frame %d of region of interest %d, the writer thread is falling behind", frame_num, i);
+                }
+            }
+            frame_num++;
+            buf_num = 0;
+            buf_bytes_read = 0;
+            frame_bytes = 0;
+        }
+        // Request the buffer to be filled again by the camera component
+        mark_buffer_enqueued(buffer);
+        if((r = OMX_FillThisBuffer(ctx.camera, buffer)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
         }
-        // Would be better to use signaling here but hey this works too
-        usleep(10);
     }
+    capture_ns = get_time_ns() - capture_start_ns;
+    get_page_faults(&minor_faults, &major_faults);
+    say("Page faults in the capture loop: %ld minor, %ld major, %ld minor and %ld major in total",
+        minor_faults - minor_faults_start, major_faults - major_faults_start, minor_faults, major_faults);
     say("Cleaning up...");
 
+    if(ctx.scatter_output) {
+        // A partly unpacked frame is cut off
+        output_map_close(&ctx.output);
+        dump_output_map_stats(&ctx.output);
+    } else if(full_frame_output) {
+        // Wait for the queued frames to be written
+        frame_writer_stop(&ctx.writer);
+        dump_writer_stats("Writer", &ctx.writer);
+        if(frame) {
+            frame_pool_unref(&ctx.frames, frame);
+        }
+        dump_frame_pool_stats("Frame pool", &ctx.frames);
+        frame_pool_destroy(&ctx.frames);
+    }
+    if(downscale_factor) {
+        frame_writer_stop(&ctx.reduced_writer);
+        dump_writer_stats("Reduced frame writer", &ctx.reduced_writer);
+        if(reduced) {
+            frame_pool_unref(&ctx.reduced_frames, reduced);
+        }
+        dump_frame_pool_stats("Reduced frame pool", &ctx.reduced_frames);
+        frame_pool_destroy(&ctx.reduced_frames);
+        fclose(ctx.fd_reduced);
+    }
+    for(i = 0; i < roi_count; i++) {
+        frame_writer_stop(&rois[i].writer);
+        if(rois[i].frame) {
+            frame_pool_unref(&rois[i].frames, rois[i].frame);
+        }
+        say("Region of interest %d: %u slices copied, %u slices skipped, %d frames dropped",
+            i, rois[i].slices_copied, rois[i].slices_skipped, rois[i].frames.frames_dropped);
+        frame_pool_destroy(&rois[i].frames);
+        fclose(rois[i].fd);
+    }
+    if(full_frame_output) {
+        dump_throughput(output_format_names[frame_info.format],
+            ctx.scatter_output ? ctx.output.frames_written : ctx.writer.frames_written, frame_info.size, capture_ns);
+    }
+    if(downscale_factor) {
+        dump_throughput("Reduced I420", ctx.reduced_writer.frames_written, reduced_info.size, capture_ns);
+    }
+    for(i = 0; i < roi_count; i++) {
+        dump_throughput(rois[i].region.file, rois[i].writer.frames_written, rois[i].frame_info.size, capture_ns);
+    }
+    free(rois);
+    dump_jitter_stats(&jitter);
+
     // Restore signal handlers
     signal(SIGINT,  SIG_DFL);
     signal(SIGTERM, SIG_DFL);
     signal(SIGQUIT, SIG_DFL);
 
+    // Tear down all the components at once, all the steps
+    // together have to complete within TEARDOWN_TIMEOUT
+    unsigned long long teardown_ns = get_time_ns();
+    unsigned long long teardown_deadline_ns = teardown_ns + TEARDOWN_TIMEOUT * 1000000ULL;
+    phase_ns = teardown_ns;
+
     // Stop capturing video with the camera
     OMX_INIT_STRUCTURE(capture);
     capture.nPortIndex = 71;
@@ -950,7 +3255,8 @@ int main(int argc, char **argv) {
     }
 
     // Return the last full buffer back to the camera component
-    if((r = OMX_FillThisBuffer(ctx.camera, ctx.camera_ppBuffer_out)) != OMX_ErrorNone) {
+    mark_buffer_enqueued(buffer);
+    if((r = OMX_FillThisBuffer(ctx.camera, buffer)) != OMX_ErrorNone) {
         omx_die(r, "Failed to request filling of the output buffer on camera video output port 71");
     }
 
@@ -958,63 +3264,78 @@ int main(int argc, char **argv) {
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera input port 73");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 73);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera preview output port 70");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 70);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera video output port 71");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 71);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandFlush, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of null sink input port 240");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandFlush, 240);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "flush");
 
     // Disable all the ports
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera input port 73");
     }
-    block_until_port_changed(ctx.camera, 73, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 73);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera preview output port 70");
     }
-    block_until_port_changed(ctx.camera, 70, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 70);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera video output port 71");
     }
-    block_until_port_changed(ctx.camera, 71, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 71);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortDisable, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable null sink input port 240");
     }
-    block_until_port_changed(ctx.null_sink, 240, OMX_FALSE);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandPortDisable, 240);
 
     // Free all the buffers
     if((r = OMX_FreeBuffer(ctx.camera, 73, ctx.camera_ppBuffer_in)) != OMX_ErrorNone) {
         omx_die(r, "Failed to free buffer for camera input port 73");
     }
-    if((r = OMX_FreeBuffer(ctx.camera, 71, ctx.camera_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for camera video output port 71");
+    for(i = 0; i < ctx.camera_output_buffer_count; i++) {
+        if((r = OMX_FreeBuffer(ctx.camera, 71, ctx.camera_ppBuffer_out[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to free buffer %d for camera video output port 71", i);
+        }
     }
+    free(ctx.camera_ppBuffer_out);
+    free(ctx.camera_output_buffer_meta);
+
+    // Disabling a port completes only once its buffers have been freed
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "disable");
 
-    // Transition all the components to idle and then to loaded states
+    // Transition all the components to idle and then to loaded states,
+    // all of them are idle before any of them is switched to loaded
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to idle");
     }
-    block_until_state_changed(ctx.camera, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateIdle);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to idle");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "idle");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to loaded");
     }
-    block_until_state_changed(ctx.camera, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateLoaded);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to loaded");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "loaded");
 
     // Free the component handles
     if((r = OMX_FreeHandle(ctx.camera)) != OMX_ErrorNone) {
@@ -1023,12 +3344,15 @@ int main(int argc, char **argv) {
     if((r = OMX_FreeHandle(ctx.null_sink)) != OMX_ErrorNone) {
         omx_die(r, "Failed to free null sink component handle");
     }
+    end_phase(&phase_ns, "Teardown", "free handles");
+    say("Teardown took %.1f ms", (get_time_ns() - teardown_ns) / 1e6);
 
     // Exit
     fclose(ctx.fd_out);
-    free(frame);
 
-    vcos_semaphore_delete(&ctx.handler_lock);
+    pthread_cond_destroy(&ctx.command_cond);
+    pthread_mutex_destroy(&ctx.command_lock);
+    vcos_semaphore_delete(&ctx.camera_output_buffer_ready);
     if((r = OMX_Deinit()) != OMX_ErrorNone) {
         omx_die(r, "OMX de-initalization failed");
     }
@@ -44,12 +44,20 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include <bcm_host.h>
 
@@ -66,6 +74,12 @@
 #define VIDEO_HEIGHT                    1080
 #define VIDEO_FRAMERATE                 25
 #define VIDEO_BITRATE                   10000000
+#define ENCODER_OUTPUT_BUFFERS          8                       // at least nBufferCountActual of port 201
+#define WRITER_RING_SIZE                (8 * 1024 * 1024)       // bytes
+#define MEMORY_BUDGET                   0                       // MB for port buffers and rings, 0 uses the counts above
+#define WRITER_HIGH_WATER_MARK          (6 * 1024 * 1024)       // bytes
+#define DIRECT_PIPE_OUTPUT              0                       // 1 writes the encoder buffers to a pipe without the ring
+#define PIPE_DRAIN_TIMEOUT              1000                    // ms, for the reader of the output pipe on exit
 #define CAM_DEVICE_NUMBER               0
 #define CAM_SHARPNESS                   0                       // -100 .. 100
 #define CAM_CONTRAST                    0                       // -100 .. 100
@@ -79,6 +93,19 @@
 #define CAM_IMAGE_FILTER                OMX_ImageFilterNoise    // OMX_IMAGEFILTERTYPE
 #define CAM_FLIP_HORIZONTAL             OMX_FALSE
 #define CAM_FLIP_VERTICAL               OMX_FALSE
+#define MAIN_THREAD_POLICY              SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define MAIN_THREAD_PRIORITY            0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define MAIN_THREAD_CPU                 -1                      // -1 doesn't pin the thread
+#define WRITER_THREAD_POLICY            SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define WRITER_THREAD_PRIORITY          0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define WRITER_THREAD_CPU               -1                      // -1 doesn't pin the thread
+#define CALLBACK_THREAD_POLICY          SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define CALLBACK_THREAD_PRIORITY        0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define CALLBACK_THREAD_CPU             -1                      // -1 doesn't pin the thread
+#define JITTER_LOG_THRESHOLD            5                       // ms
+#define CONCURRENT_BRINGUP              1                       // 0 waits for each startup command in turn
+#define OMX_COMMAND_TIMEOUT             2000                    // ms
+#define TEARDOWN_TIMEOUT                1000                    // ms, for the whole teardown
 
 // Dunno where this is originally stolen from...
 #define OMX_INIT_STRUCTURE(a) \
@@ -92,6 +119,104 @@
 
 // Global variable used by the signal handler and capture/encoding loop
 static int want_quit = 0;
+// Posted by the signal handler to wake up the capture/encoding loop, which
+// may be waiting for buffers held up by a stalled output
+static VCOS_SEMAPHORE_T *quit_semaphore;
+
+// Statistics about how the capture/encoding loop spends its time
+typedef struct {
+    unsigned int wakeups;
+    unsigned long long loop_start_ns;
+    unsigned long long idle_ns;
+    unsigned long long wakeup_latency_ns;
+    unsigned long long wakeup_latency_max_ns;
+} loop_stats;
+
+// OMX_EventCmdComplete event received by the event handler
+// but not yet waited for by the main routine
+#define MAX_COMMAND_EVENTS 32
+typedef struct {
+    OMX_HANDLETYPE hComponent;
+    OMX_U32 nCommand;
+    OMX_U32 nData2;
+} omx_command_event;
+
+// Commands sent to the components but not yet waited for
+#define MAX_PENDING_COMMANDS 32
+
+// Single producer, single consumer ring of buffer headers passed from an OMX
+// callback to the main loop without locking. Only the producer writes head
+// and only the consumer writes tail. It must have room for all the buffers
+// of the port so that pushing never fails.
+#define BUFFER_RING_SIZE 32 // power of two
+typedef struct {
+    OMX_BUFFERHEADERTYPE *buffers[BUFFER_RING_SIZE];
+    unsigned long long pushed_ns[BUFFER_RING_SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+} buffer_ring;
+
+// Bounded ring of encoded data queued by the main loop for the writer
+// thread, so that a slow output file doesn't hold up the encoder buffers.
+// head and tail count the bytes queued and written since the start.
+// With direct_pipe the encoder buffers themselves are queued instead, and
+// they are written from the buffer memory to the output pipe.
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    unsigned long long head;
+    unsigned long long tail;
+    int done;
+    unsigned long long stop_deadline_ns;
+    FILE *fd;
+    OMX_HANDLETYPE encoder;
+    int direct_pipe;
+    OMX_BUFFERHEADERTYPE *queued[BUFFER_RING_SIZE];
+    unsigned int queued_first;
+    unsigned int queued_count;
+    // The reader of the pipe didn't keep up until the stop deadline
+    int reader_stalled;
+    unsigned long long dropped;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t data_available;
+    pthread_cond_t space_available;
+    // Statistics
+    size_t depth_max;
+    unsigned long long depth_sum;
+    unsigned int depth_samples;
+    int above_high_water_mark;
+    unsigned int high_water_mark_hits;
+    unsigned long long write_stall_max_ns;
+    unsigned long long queue_blocked_ns;
+} output_writer;
+
+// Metadata of a buffer, preallocated in one slab for all the buffers of a
+// port and attached to the buffer header with pAppPrivate
+typedef struct {
+    int buffer_index;
+    unsigned int sequence;          // times the component has returned the buffer
+    OMX_TICKS timestamp;            // nTimeStamp when last returned
+    OMX_U32 flags;                  // nFlags when last returned
+    unsigned long long enqueue_ns;  // when last handed to the component
+    unsigned long long dequeue_ns;  // when last returned by the component
+    int frame_index;
+    int slice_index;
+} buffer_meta;
+
+#define BUFFER_META(buffer) ((buffer_meta*)(buffer)->pAppPrivate)
+
+// A pool of port buffers or ring slots sized by plan_buffers(). Port
+// buffer pools have the component and the port set.
+typedef struct {
+    const char *name;
+    OMX_HANDLETYPE component;
+    OMX_U32 port;
+    size_t size;        // bytes per buffer
+    int count_min;
+    int count_max;
+    int count;
+} buffer_plan;
 
 // Our application context passed around
 // the main routine and callback handlers
@@ -100,14 +225,36 @@ typedef struct {
     OMX_BUFFERHEADERTYPE *camera_ppBuffer_in;
     int camera_ready;
     OMX_HANDLETYPE encoder;
-    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_out;
-    int encoder_output_buffer_available;
+    OMX_BUFFERHEADERTYPE **encoder_ppBuffer_out;
+    buffer_meta *encoder_output_buffer_meta;
+    int encoder_output_buffer_count;
+    buffer_ring encoder_output_buffers_filled;
     OMX_HANDLETYPE null_sink;
-    int flushed;
     FILE *fd_out;
-    VCOS_SEMAPHORE_T handler_lock;
+    size_t writer_ring_size;
+    output_writer writer;
+    omx_command_event command_events[MAX_COMMAND_EVENTS];
+    int command_events_count;
+    omx_command_event pending_commands[MAX_PENDING_COMMANDS];
+    int pending_commands_count;
+    pthread_mutex_t command_lock;
+    pthread_cond_t command_cond;
+    VCOS_SEMAPHORE_T encoder_output_buffer_ready;
+    loop_stats stats;
 } appctx;
 
+// Frame to frame jitter as seen by the main loop, i.e. how much the interval
+// between two frames differs from the interval between the previous two
+typedef struct {
+    unsigned int frames;
+    unsigned long long last_ns;
+    unsigned long long last_interval_ns;
+    unsigned int samples;
+    unsigned int over_threshold;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+} jitter_stats;
+
 // Ugly, stupid utility functions
 static void say(const char* message, ...) {
     va_list args;
@@ -134,6 +281,114 @@ static void die(const char* message, ...) {
     exit(1);
 }
 
+static unsigned long long get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Apply the scheduling policy, priority and CPU affinity configured
+// for a thread role to the calling thread. Failing to do so, e.g. for
+// the lack of privileges for real-time scheduling, isn't fatal.
+static void set_thread_scheduling(const char *role, int policy, int priority, int cpu) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int r;
+    say("Scheduling the %s thread with policy %d, priority %d, CPU %d", role, policy, priority, cpu);
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if((r = pthread_setschedparam(pthread_self(), policy, &param)) != 0) {
+        say("Failed to set scheduling policy of the %s thread: %s", role, strerror(r));
+    }
+    if(cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if((r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0) {
+            say("Failed to set CPU affinity of the %s thread: %s", role, strerror(r));
+        }
+    }
+}
+
+// OMX calls the handlers from its own thread, so the settings
+// are applied by the first handler called in that thread
+static __thread int callback_thread_configured = 0;
+static void configure_callback_thread(void) {
+    if(!callback_thread_configured) {
+        callback_thread_configured = 1;
+        set_thread_scheduling("OMX callback", CALLBACK_THREAD_POLICY, CALLBACK_THREAD_PRIORITY, CALLBACK_THREAD_CPU);
+    }
+}
+
+// Allocates the metadata of all the buffers of a port at once
+static buffer_meta *alloc_buffer_meta(int count) {
+    buffer_meta *meta = calloc(count, sizeof(buffer_meta));
+    int i;
+    if(!meta) {
+        die("Failed to allocate metadata for %d buffers", count);
+    }
+    for(i = 0; i < count; i++) {
+        meta[i].buffer_index = i;
+    }
+    return meta;
+}
+
+// Called right before the buffer is handed to the component
+static void mark_buffer_enqueued(OMX_BUFFERHEADERTYPE *buffer) {
+    BUFFER_META(buffer)->enqueue_ns = get_time_ns();
+}
+
+// Called by the buffer done handlers when the component returns the buffer
+static void mark_buffer_dequeued(OMX_BUFFERHEADERTYPE *buffer) {
+    buffer_meta *meta = BUFFER_META(buffer);
+    meta->dequeue_ns = get_time_ns();
+    meta->timestamp = buffer->nTimeStamp;
+    meta->flags = buffer->nFlags;
+    meta->sequence++;
+}
+
+static long long get_timestamp_us(OMX_TICKS ticks) {
+#ifdef OMX_SKIP64BIT
+    return ((long long)ticks.nHighPart << 32) | ticks.nLowPart;
+#else
+    return ticks;
+#endif
+}
+
+// Called by the main loop for each frame
+static void add_frame_arrival(jitter_stats *jitter) {
+    unsigned long long now_ns = get_time_ns(), interval_ns, jitter_ns;
+    jitter->frames++;
+    if(jitter->last_ns) {
+        interval_ns = now_ns - jitter->last_ns;
+        if(jitter->last_interval_ns) {
+            jitter_ns = interval_ns > jitter->last_interval_ns
+                ? interval_ns - jitter->last_interval_ns
+                : jitter->last_interval_ns - interval_ns;
+            jitter->samples++;
+            jitter->sum_ns += jitter_ns;
+            if(jitter_ns > jitter->max_ns) {
+                jitter->max_ns = jitter_ns;
+            }
+            if(jitter_ns > JITTER_LOG_THRESHOLD * 1000000ULL) {
+                jitter->over_threshold++;
+                say("Frame %d arrived with %.1f ms jitter", jitter->frames, jitter_ns / 1e6);
+            }
+        }
+        jitter->last_interval_ns = interval_ns;
+    }
+    jitter->last_ns = now_ns;
+}
+
+static void dump_jitter_stats(const jitter_stats *jitter) {
+    say("Frame jitter:\n"
+        "\tAverage:\t\t%.1f us\n"
+        "\tMax:\t\t\t%.1f us\n"
+        "\tOver %d ms:\t\t%u of %u frames\n",
+            jitter->samples ? jitter->sum_ns / 1e3 / jitter->samples : 0.0,
+            jitter->max_ns / 1e3,
+            JITTER_LOG_THRESHOLD, jitter->over_threshold, jitter->samples);
+}
+
 static void omx_die(OMX_ERRORTYPE error, const char* message, ...) {
     va_list args;
     char str[1024];
@@ -347,49 +602,505 @@ static void dump_port(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL du
     }
 }
 
-// Some busy loops to verify we're running in order
-static void block_until_state_changed(OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState) {
-    OMX_STATETYPE eState;
-    int i = 0;
-    while(i++ == 0 || eState != wanted_eState) {
-        OMX_GetState(hComponent, &eState);
-        if(eState != wanted_eState) {
-            usleep(10000);
+// Fills in a buffer plan entry for a port from its port definition
+static void init_port_plan(buffer_plan *plan, const char *name, OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex) {
+    OMX_ERRORTYPE r;
+    OMX_PARAM_PORTDEFINITIONTYPE portdef;
+    OMX_INIT_STRUCTURE(portdef);
+    portdef.nPortIndex = nPortIndex;
+    if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for %s", name);
+    }
+    plan->name = name;
+    plan->component = hComponent;
+    plan->port = nPortIndex;
+    plan->size = portdef.nBufferSize;
+    plan->count_min = portdef.nBufferCountMin;
+    plan->count_max = BUFFER_RING_SIZE;
+}
+
+// Shares the memory budget out among the pools. Each pool gets its minimum
+// number of buffers first, then the rest is handed out one buffer at a time
+// to each pool in turn. The buffer counts of the ports are set to the plan.
+static void plan_buffers(buffer_plan *plan, int plan_count, size_t budget) {
+    OMX_ERRORTYPE r;
+    OMX_PARAM_PORTDEFINITIONTYPE portdef;
+    size_t used = 0;
+    int i, added;
+    for(i = 0; i < plan_count; i++) {
+        plan[i].count = plan[i].count_min;
+        used += plan[i].size * plan[i].count;
+    }
+    if(used > budget) {
+        die("Memory budget of %zu bytes doesn't cover the %zu bytes of the minimum buffer counts", budget, used);
+    }
+    do {
+        added = 0;
+        for(i = 0; i < plan_count; i++) {
+            if(plan[i].count < plan[i].count_max && used + plan[i].size <= budget) {
+                plan[i].count++;
+                used += plan[i].size;
+                added = 1;
+            }
+        }
+    } while(added);
+    say("Buffer plan for memory budget of %zu bytes:", budget);
+    for(i = 0; i < plan_count; i++) {
+        say("\t%s: %d buffers of %zu bytes, %zu bytes (%d .. %d buffers)",
+            plan[i].name, plan[i].count, plan[i].size, plan[i].size * plan[i].count, plan[i].count_min, plan[i].count_max);
+        if(!plan[i].component) {
+            continue;
+        }
+        OMX_INIT_STRUCTURE(portdef);
+        portdef.nPortIndex = plan[i].port;
+        if((r = OMX_GetParameter(plan[i].component, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to get port definition for %s", plan[i].name);
+        }
+        portdef.nBufferCountActual = plan[i].count;
+        if((r = OMX_SetParameter(plan[i].component, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to set buffer count for %s", plan[i].name);
         }
     }
+    say("\tTotal %zu bytes, %zu bytes left", used, budget - used);
+}
+
+// Called by the producer, i.e. an OMX callback
+static void buffer_ring_push(buffer_ring *ring, OMX_BUFFERHEADERTYPE *buffer) {
+    unsigned int head = ring->head;
+    if(head - ring->tail == BUFFER_RING_SIZE) {
+        die("Buffer ring is full");
+    }
+    ring->buffers[head % BUFFER_RING_SIZE] = buffer;
+    ring->pushed_ns[head % BUFFER_RING_SIZE] = get_time_ns();
+    // Make sure the entry is written before it's published
+    __sync_synchronize();
+    ring->head = head + 1;
+}
+
+// Called by the consumer, i.e. the main loop, returns NULL if the ring is empty
+static OMX_BUFFERHEADERTYPE *buffer_ring_pop(buffer_ring *ring, unsigned long long *pushed_ns) {
+    unsigned int tail = ring->tail;
+    OMX_BUFFERHEADERTYPE *buffer;
+    if(tail == ring->head) {
+        return NULL;
+    }
+    // Make sure the entry is read only after seeing the new head,
+    // and read before the slot is handed back to the producer
+    __sync_synchronize();
+    buffer = ring->buffers[tail % BUFFER_RING_SIZE];
+    *pushed_ns = ring->pushed_ns[tail % BUFFER_RING_SIZE];
+    __sync_synchronize();
+    ring->tail = tail + 1;
+    return buffer;
+}
+
+// Convert a timeout relative to now to an absolute
+// CLOCK_MONOTONIC deadline for pthread_cond_timedwait()
+static void get_deadline(int timeout_ms, struct timespec *deadline) {
+    unsigned long long deadline_ns = get_time_ns() + timeout_ms * 1000000ULL;
+    deadline->tv_sec  = deadline_ns / 1000000000ULL;
+    deadline->tv_nsec = deadline_ns % 1000000000ULL;
 }
 
-static void block_until_port_changed(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled) {
+// Wait until the event handler has received OMX_EventCmdComplete
+// for the given command, returns -1 if timeout_ms elapsed before that
+static int wait_for_command_complete(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2, int timeout_ms) {
+    struct timespec deadline;
+    int i, found = 0, timed_out = 0;
+    get_deadline(timeout_ms, &deadline);
+    pthread_mutex_lock(&ctx->command_lock);
+    while(1) {
+        for(i = 0; i < ctx->command_events_count; i++) {
+            omx_command_event *e = &ctx->command_events[i];
+            if(e->hComponent == hComponent && e->nCommand == nCommand && e->nData2 == nData2) {
+                // Consume the event so that it won't satisfy a later wait
+                *e = ctx->command_events[--ctx->command_events_count];
+                found = 1;
+                break;
+            }
+        }
+        if(found || timed_out) {
+            break;
+        }
+        timed_out = pthread_cond_timedwait(&ctx->command_cond, &ctx->command_lock, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&ctx->command_lock);
+    return found ? 0 : -1;
+}
+
+// Some blocking waits to verify we're running in order
+static void block_until_port_changed(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled, int timeout_ms) {
+    OMX_COMMANDTYPE nCommand = bEnabled ? OMX_CommandPortEnable : OMX_CommandPortDisable;
+    if(wait_for_command_complete(ctx, hComponent, nCommand, nPortIndex, timeout_ms) != 0) {
+        die("Timed out after %d ms waiting for port %d of component 0x%08x to be %s",
+            timeout_ms, nPortIndex, hComponent, bEnabled ? "enabled" : "disabled");
+    }
+}
+
+// Milliseconds left until the deadline, 0 if it has already passed
+static int get_remaining_ms(unsigned long long deadline_ns) {
+    unsigned long long now_ns = get_time_ns();
+    return now_ns < deadline_ns ? (deadline_ns - now_ns + 999999ULL) / 1000000ULL : 0;
+}
+
+// Wait for all the pending commands at once. They are carried out
+// concurrently by the components, so they share a single deadline.
+static void block_until_commands_complete(appctx *ctx, int timeout_ms) {
+    unsigned long long deadline_ns = get_time_ns() + timeout_ms * 1000000ULL;
+    int i;
+    for(i = 0; i < ctx->pending_commands_count; i++) {
+        omx_command_event *e = &ctx->pending_commands[i];
+        if(wait_for_command_complete(ctx, e->hComponent, e->nCommand, e->nData2, get_remaining_ms(deadline_ns)) != 0) {
+            die("Timed out after %d ms waiting for component 0x%08x to complete command %d for %d",
+                timeout_ms, e->hComponent, e->nCommand, e->nData2);
+        }
+    }
+    ctx->pending_commands_count = 0;
+}
+
+// Remember a command sent to a component so that it can be waited for
+// together with the others by block_until_commands_complete()
+static void add_pending_command(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2) {
+    if(ctx->pending_commands_count == MAX_PENDING_COMMANDS) {
+        die("Too many pending commands");
+    }
+    omx_command_event *e = &ctx->pending_commands[ctx->pending_commands_count++];
+    e->hComponent = hComponent;
+    e->nCommand = nCommand;
+    e->nData2 = nData2;
+}
+
+// Same for a startup command, which is waited for
+// right away without CONCURRENT_BRINGUP
+static void expect_command_complete(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2) {
+    add_pending_command(ctx, hComponent, nCommand, nData2);
+    if(!CONCURRENT_BRINGUP) {
+        block_until_commands_complete(ctx, OMX_COMMAND_TIMEOUT);
+    }
+}
+
+// Log the time spent in a startup or teardown phase and start timing the next one
+static void end_phase(unsigned long long *phase_start_ns, const char *sequence, const char *phase) {
+    unsigned long long now_ns = get_time_ns();
+    say("%s phase %s took %.1f ms", sequence, phase, (now_ns - *phase_start_ns) / 1e6);
+    *phase_start_ns = now_ns;
+}
+
+static void block_until_camera_ready(appctx *ctx, int timeout_ms) {
+    struct timespec deadline;
+    int timed_out = 0;
+    get_deadline(timeout_ms, &deadline);
+    pthread_mutex_lock(&ctx->command_lock);
+    while(!ctx->camera_ready && !timed_out) {
+        timed_out = pthread_cond_timedwait(&ctx->command_cond, &ctx->command_lock, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&ctx->command_lock);
+    if(!ctx->camera_ready) {
+        die("Timed out after %d ms waiting for the camera to become ready", timeout_ms);
+    }
+}
+
+// Sleep until fill_output_buffer_done_handler() wakes us up, take the oldest
+// filled buffer and account the time spent sleeping and the wakeup latency.
+// Once quitting, returns NULL if no buffer comes within OMX_COMMAND_TIMEOUT.
+static OMX_BUFFERHEADERTYPE *block_until_output_buffer_available(appctx *ctx) {
+    unsigned long long wait_start_ns = get_time_ns(), wakeup_ns, filled_ns = 0, latency_ns;
+    OMX_BUFFERHEADERTYPE *buffer;
+    // The semaphore is posted once for each buffer pushed to the ring,
+    // and by the signal handler without a buffer
+    do {
+        if(!want_quit) {
+            vcos_semaphore_wait(&ctx->encoder_output_buffer_ready);
+        } else if(vcos_semaphore_wait_timeout(&ctx->encoder_output_buffer_ready, OMX_COMMAND_TIMEOUT) != VCOS_SUCCESS) {
+            return NULL;
+        }
+        buffer = buffer_ring_pop(&ctx->encoder_output_buffers_filled, &filled_ns);
+    } while(!buffer);
+    wakeup_ns = get_time_ns();
+    latency_ns = wakeup_ns - filled_ns;
+    ctx->stats.wakeups++;
+    ctx->stats.idle_ns += wakeup_ns - wait_start_ns;
+    ctx->stats.wakeup_latency_ns += latency_ns;
+    if(latency_ns > ctx->stats.wakeup_latency_max_ns) {
+        ctx->stats.wakeup_latency_max_ns = latency_ns;
+    }
+    return buffer;
+}
+
+static void dump_loop_stats(const loop_stats *stats) {
+    unsigned long long loop_ns = get_time_ns() - stats->loop_start_ns;
+    say("Capture and encode loop statistics:\n"
+        "\tLoop time:\t\t%.3f s\n"
+        "\tWakeups:\t\t%u\n"
+        "\tIdle time:\t\t%.3f s (%.1f%%)\n"
+        "\tWakeup latency:\t\tavg %.1f us, max %.1f us\n",
+        loop_ns / 1e9,
+        stats->wakeups,
+        stats->idle_ns / 1e9,
+        loop_ns ? 100.0 * stats->idle_ns / loop_ns : 0.0,
+        stats->wakeups ? stats->wakeup_latency_ns / 1e3 / stats->wakeups : 0.0,
+        stats->wakeup_latency_max_ns / 1e3);
+}
+
+// Writes the queued data to the output file until the ring
+// has been drained after output_writer_stop() was called
+static void *output_writer_thread(void *arg) {
+    output_writer *writer = (output_writer*)arg;
+    unsigned long long write_start_ns, write_ns;
+    size_t offset, len, written;
+    set_thread_scheduling("writer", WRITER_THREAD_POLICY, WRITER_THREAD_PRIORITY, WRITER_THREAD_CPU);
+    pthread_mutex_lock(&writer->lock);
+    while(1) {
+        while(writer->head == writer->tail && !writer->done) {
+            pthread_cond_wait(&writer->data_available, &writer->lock);
+        }
+        if(writer->head == writer->tail) {
+            break;
+        }
+        // Write the data up to the end of the ring at once
+        offset = writer->tail % writer->size;
+        len = writer->head - writer->tail;
+        if(len > writer->size - offset) {
+            len = writer->size - offset;
+        }
+        pthread_mutex_unlock(&writer->lock);
+        write_start_ns = get_time_ns();
+        written = fwrite(writer->data + offset, 1, len, writer->fd);
+        write_ns = get_time_ns() - write_start_ns;
+        if(written != len) {
+            die("Failed to write to output file: %s", strerror(errno));
+        }
+        pthread_mutex_lock(&writer->lock);
+        writer->tail += len;
+        if(write_ns > writer->write_stall_max_ns) {
+            writer->write_stall_max_ns = write_ns;
+        }
+        pthread_cond_signal(&writer->space_available);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Whether the reader of the output pipe has held up output_writer_stop()
+// for longer than PIPE_DRAIN_TIMEOUT
+static int output_writer_past_deadline(output_writer *writer) {
+    int past;
+    pthread_mutex_lock(&writer->lock);
+    past = writer->done && get_time_ns() >= writer->stop_deadline_ns;
+    pthread_mutex_unlock(&writer->lock);
+    return past;
+}
+
+// Write the data of the encoder buffer to the output pipe without copying it
+// to the ring. write() copies it to pages owned by the pipe, so the buffer
+// can be handed back to the encoder right away whatever the reader does with
+// the data. Each write fits in the pipe once poll() says it is writable, so
+// the writer never blocks in write() and notices the stop deadline.
+static void write_output_buffer(output_writer *writer, OMX_BUFFERHEADERTYPE *buffer) {
     OMX_ERRORTYPE r;
-    OMX_PARAM_PORTDEFINITIONTYPE portdef;
-    OMX_INIT_STRUCTURE(portdef);
-    portdef.nPortIndex = nPortIndex;
-    OMX_U32 i = 0;
-    while(i++ == 0 || portdef.bEnabled != bEnabled) {
-        if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
-            omx_die(r, "Failed to get port definition");
+    struct pollfd pfd;
+    unsigned char *data = buffer->pBuffer + buffer->nOffset;
+    size_t len = buffer->nFilledLen;
+    ssize_t n;
+    pfd.fd = fileno(writer->fd);
+    pfd.events = POLLOUT;
+    while(len > 0 && !writer->reader_stalled) {
+        n = poll(&pfd, 1, 100);
+        if(n == 0) {
+            if(output_writer_past_deadline(writer)) {
+                say("Reader of the output pipe stalled, dropping the rest of the output");
+                writer->reader_stalled = 1;
+            }
+            continue;
+        }
+        if(n > 0) {
+            n = write(pfd.fd, data, len < PIPE_BUF ? len : PIPE_BUF);
         }
-        if(portdef.bEnabled != bEnabled) {
-            usleep(10000);
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            die("Failed to write to output file: %s", strerror(errno));
         }
+        data += n;
+        len -= n;
+    }
+    writer->dropped += len;
+    // Buffer flushed, request it to be filled again by the encoder component
+    mark_buffer_enqueued(buffer);
+    if((r = OMX_FillThisBuffer(writer->encoder, buffer)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
     }
 }
 
-static void block_until_flushed(appctx *ctx) {
-    int quit;
-    while(!quit) {
-        vcos_semaphore_wait(&ctx->handler_lock);
-        if(ctx->flushed) {
-            ctx->flushed = 0;
-            quit = 1;
+// Writes the queued encoder buffers until output_writer_stop() was called
+// and all of them have been written and handed back to the encoder
+static void *output_writer_direct_pipe_thread(void *arg) {
+    output_writer *writer = (output_writer*)arg;
+    OMX_BUFFERHEADERTYPE *buffer;
+    unsigned long long write_start_ns, write_ns;
+    size_t len;
+    set_thread_scheduling("writer", WRITER_THREAD_POLICY, WRITER_THREAD_PRIORITY, WRITER_THREAD_CPU);
+    pthread_mutex_lock(&writer->lock);
+    while(1) {
+        while(writer->queued_count == 0 && !writer->done) {
+            pthread_cond_wait(&writer->data_available, &writer->lock);
+        }
+        if(writer->queued_count == 0) {
+            break;
+        }
+        buffer = writer->queued[writer->queued_first];
+        writer->queued_first = (writer->queued_first + 1) % BUFFER_RING_SIZE;
+        writer->queued_count--;
+        pthread_mutex_unlock(&writer->lock);
+        // The encoder may refill the buffer as soon as it has been written
+        len = buffer->nFilledLen;
+        write_start_ns = get_time_ns();
+        write_output_buffer(writer, buffer);
+        write_ns = get_time_ns() - write_start_ns;
+        pthread_mutex_lock(&writer->lock);
+        writer->tail += len;
+        if(write_ns > writer->write_stall_max_ns) {
+            writer->write_stall_max_ns = write_ns;
+        }
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+// Skipping the ring only pays off with a pipe, which copies the data to
+// pages of its own anyway. The ring is kept for files so that the encoder buffers aren't
+// held up by the stalls of the storage.
+static int output_is_pipe(FILE *fd) {
+    struct stat st;
+    if(fstat(fileno(fd), &st) != 0) {
+        die("Failed to stat output file: %s", strerror(errno));
+    }
+    return S_ISFIFO(st.st_mode);
+}
+
+static void output_writer_start(output_writer *writer, FILE *fd, OMX_HANDLETYPE encoder, size_t ring_size) {
+    writer->fd = fd;
+    writer->encoder = encoder;
+    if(writer->direct_pipe) {
+        say("Writing output buffers to the output pipe without the ring");
+    } else {
+        writer->size = ring_size;
+        writer->data = malloc(writer->size);
+        if(!writer->data) {
+            die("Failed to allocate %d bytes for the writer ring", writer->size);
         }
-        vcos_semaphore_post(&ctx->handler_lock);
-        if(!quit) {
-            usleep(10000);
+    }
+    if(pthread_mutex_init(&writer->lock, NULL) != 0 ||
+            pthread_cond_init(&writer->data_available, NULL) != 0 ||
+            pthread_cond_init(&writer->space_available, NULL) != 0) {
+        die("Failed to create writer ring lock");
+    }
+    if(pthread_create(&writer->thread, NULL,
+            writer->direct_pipe ? output_writer_direct_pipe_thread : output_writer_thread, writer) != 0) {
+        die("Failed to create writer thread");
+    }
+}
+
+// Called with the writer lock held after queuing data
+static void account_queue_depth(output_writer *writer) {
+    size_t depth = writer->head - writer->tail;
+    if(depth > writer->depth_max) {
+        writer->depth_max = depth;
+    }
+    writer->depth_sum += depth;
+    writer->depth_samples++;
+    if(depth >= WRITER_HIGH_WATER_MARK && !writer->above_high_water_mark) {
+        say("Writer is falling behind, %d bytes queued", depth);
+        writer->above_high_water_mark = 1;
+        writer->high_water_mark_hits++;
+    } else if(depth < WRITER_HIGH_WATER_MARK) {
+        writer->above_high_water_mark = 0;
+    }
+}
+
+// Copy data to the ring, blocks only if the ring is full
+static void output_writer_queue(output_writer *writer, const unsigned char *data, size_t len) {
+    unsigned long long blocked_start_ns;
+    size_t offset, depth, n;
+    pthread_mutex_lock(&writer->lock);
+    while(len > 0) {
+        depth = writer->head - writer->tail;
+        if(depth == writer->size) {
+            blocked_start_ns = get_time_ns();
+            pthread_cond_wait(&writer->space_available, &writer->lock);
+            writer->queue_blocked_ns += get_time_ns() - blocked_start_ns;
+            continue;
+        }
+        offset = writer->head % writer->size;
+        n = writer->size - depth;
+        if(n > writer->size - offset) {
+            n = writer->size - offset;
         }
+        if(n > len) {
+            n = len;
+        }
+        // The writer thread doesn't touch the free part of the ring
+        pthread_mutex_unlock(&writer->lock);
+        memcpy(writer->data + offset, data, n);
+        pthread_mutex_lock(&writer->lock);
+        writer->head += n;
+        data += n;
+        len -= n;
+        pthread_cond_signal(&writer->data_available);
+    }
+    account_queue_depth(writer);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Queue the encoder buffer itself with direct_pipe, the writer
+// thread hands it back to the encoder once it has been written
+static void output_writer_queue_buffer(output_writer *writer, OMX_BUFFERHEADERTYPE *buffer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->queued[(writer->queued_first + writer->queued_count) % BUFFER_RING_SIZE] = buffer;
+    writer->queued_count++;
+    writer->head += buffer->nFilledLen;
+    pthread_cond_signal(&writer->data_available);
+    account_queue_depth(writer);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+// Wait until the writer thread has written all the queued data, with
+// direct_pipe for at most PIPE_DRAIN_TIMEOUT as the encoder buffers are
+// needed back for the teardown
+static void output_writer_stop(output_writer *writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->done = 1;
+    writer->stop_deadline_ns = get_time_ns() + PIPE_DRAIN_TIMEOUT * 1000000ULL;
+    pthread_cond_signal(&writer->data_available);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    pthread_cond_destroy(&writer->space_available);
+    pthread_cond_destroy(&writer->data_available);
+    pthread_mutex_destroy(&writer->lock);
+    free(writer->data);
+    if(writer->dropped) {
+        say("Dropped %llu bytes of output", writer->dropped);
     }
 }
 
+static void dump_writer_stats(const output_writer *writer) {
+    say("Output writer statistics:\n"
+        "\tBytes written:\t\t%llu\n"
+        "\tQueue depth:\t\tavg %.1f KiB, max %.1f KiB\n"
+        "\tRing size:\t\t%.1f KiB\n"
+        "\tHigh-water mark hits:\t%u\n"
+        "\tLongest write stall:\t%.1f ms\n"
+        "\tQueue full time:\t%.1f ms\n",
+        writer->tail,
+        writer->depth_samples ? writer->depth_sum / 1024.0 / writer->depth_samples : 0.0,
+        writer->depth_max / 1024.0,
+        writer->size / 1024.0,
+        writer->high_water_mark_hits,
+        writer->write_stall_max_ns / 1e6,
+        writer->queue_blocked_ns / 1e6);
+}
+
 static void init_component_handle(
         const char *name,
         OMX_HANDLETYPE* hComponent,
@@ -427,7 +1138,7 @@ static void init_component_handle(
                 if((r = OMX_SendCommand(*hComponent, OMX_CommandPortDisable, nPortIndex, NULL)) != OMX_ErrorNone) {
                     omx_die(r, "Failed to disable port %d of component %s", nPortIndex, fullname);
                 }
-                block_until_port_changed(*hComponent, nPortIndex, OMX_FALSE);
+                expect_command_complete((appctx *)pAppData, *hComponent, OMX_CommandPortDisable, nPortIndex);
             }
         }
     }
@@ -436,6 +1147,9 @@ static void init_component_handle(
 // Global signal handler for trapping SIGINT, SIGTERM, and SIGQUIT
 static void signal_handler(int signal) {
     want_quit = 1;
+    if(quit_semaphore) {
+        vcos_semaphore_post(quit_semaphore);
+    }
 }
 
 // OMX calls this handler for all the events it emits
@@ -446,6 +1160,7 @@ static OMX_ERRORTYPE event_handler(
         OMX_U32 nData1,
         OMX_U32 nData2,
         OMX_PTR pEventData) {
+    configure_callback_thread();
 
     dump_event(hComponent, eEvent, nData1, nData2);
 
@@ -453,18 +1168,25 @@ static OMX_ERRORTYPE event_handler(
 
     switch(eEvent) {
         case OMX_EventCmdComplete:
-            vcos_semaphore_wait(&ctx->handler_lock);
-            if(nData1 == OMX_CommandFlush) {
-                ctx->flushed = 1;
+            // Record the event for wait_for_command_complete()
+            pthread_mutex_lock(&ctx->command_lock);
+            if(ctx->command_events_count == MAX_COMMAND_EVENTS) {
+                die("Too many command complete events pending");
             }
-            vcos_semaphore_post(&ctx->handler_lock);
+            ctx->command_events[ctx->command_events_count].hComponent = hComponent;
+            ctx->command_events[ctx->command_events_count].nCommand   = nData1;
+            ctx->command_events[ctx->command_events_count].nData2     = nData2;
+            ctx->command_events_count++;
+            pthread_cond_broadcast(&ctx->command_cond);
+            pthread_mutex_unlock(&ctx->command_lock);
             break;
         case OMX_EventParamOrConfigChanged:
-            vcos_semaphore_wait(&ctx->handler_lock);
+            pthread_mutex_lock(&ctx->command_lock);
             if(nData2 == OMX_IndexParamCameraDeviceNumber) {
                 ctx->camera_ready = 1;
+                pthread_cond_broadcast(&ctx->command_cond);
             }
-            vcos_semaphore_post(&ctx->handler_lock);
+            pthread_mutex_unlock(&ctx->command_lock);
             break;
         case OMX_EventError:
             omx_die(nData1, "error event received");
@@ -482,18 +1204,23 @@ static OMX_ERRORTYPE fill_output_buffer_done_handler(
         OMX_HANDLETYPE hComponent,
         OMX_PTR pAppData,
         OMX_BUFFERHEADERTYPE* pBuffer) {
+    configure_callback_thread();
     appctx *ctx = ((appctx*)pAppData);
-    vcos_semaphore_wait(&ctx->handler_lock);
+    mark_buffer_dequeued(pBuffer);
     // The main loop can now flush the buffer to output file
-    ctx->encoder_output_buffer_available = 1;
-    vcos_semaphore_post(&ctx->handler_lock);
+    buffer_ring_push(&ctx->encoder_output_buffers_filled, pBuffer);
+    // Wake up the main loop
+    vcos_semaphore_post(&ctx->encoder_output_buffer_ready);
     return OMX_ErrorNone;
 }
 
 int main(int argc, char **argv) {
+    unsigned long long startup_ns = get_time_ns(), phase_ns = startup_ns;
+
     bcm_host_init();
 
     OMX_ERRORTYPE r;
+    int i;
 
     if((r = OMX_Init()) != OMX_ErrorNone) {
         omx_die(r, "OMX initalization failed");
@@ -502,19 +1229,29 @@ int main(int argc, char **argv) {
     // Init context
     appctx ctx;
     memset(&ctx, 0, sizeof(ctx));
-    if(vcos_semaphore_create(&ctx.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
-        die("Failed to create handler lock semaphore");
+    pthread_condattr_t command_cond_attr;
+    pthread_condattr_init(&command_cond_attr);
+    pthread_condattr_setclock(&command_cond_attr, CLOCK_MONOTONIC);
+    if(pthread_mutex_init(&ctx.command_lock, NULL) != 0 || pthread_cond_init(&ctx.command_cond, &command_cond_attr) != 0) {
+        die("Failed to create command completion lock");
+    }
+    pthread_condattr_destroy(&command_cond_attr);
+    if(vcos_semaphore_create(&ctx.encoder_output_buffer_ready, "encoder_output_buffer_ready", 0) != VCOS_SUCCESS) {
+        die("Failed to create encoder output buffer ready semaphore");
     }
 
     // Init component handles
     OMX_CALLBACKTYPE callbacks;
-    memset(&ctx, 0, sizeof(callbacks));
+    memset(&callbacks, 0, sizeof(callbacks));
     callbacks.EventHandler   = event_handler;
     callbacks.FillBufferDone = fill_output_buffer_done_handler;
 
     init_component_handle("camera", &ctx.camera , &ctx, &callbacks);
     init_component_handle("video_encode", &ctx.encoder, &ctx, &callbacks);
     init_component_handle("null_sink", &ctx.null_sink, &ctx, &callbacks);
+    // Wait for the ports of all the components to be disabled at once
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "component handles");
 
     say("Configuring camera...");
 
@@ -666,11 +1403,6 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to set mirror configuration for camera video output port 71");
     }
 
-    // Ensure camera is ready
-    while(!ctx.camera_ready) {
-        usleep(10000);
-    }
-
     say("Configuring encoder...");
 
     say("Default port definition for encoder input port 200");
@@ -695,6 +1427,11 @@ int main(int argc, char **argv) {
     encoder_portdef.format.video.nStride      = camera_portdef.format.video.nStride;
     // Which one is effective, this or the configuration just below?
     encoder_portdef.format.video.nBitrate     = VIDEO_BITRATE;
+    // Keep a pool of buffers queued with the encoder so that it can carry
+    // on encoding while the main loop is flushing the previous buffers
+    if(encoder_portdef.nBufferCountActual < ENCODER_OUTPUT_BUFFERS) {
+        encoder_portdef.nBufferCountActual = ENCODER_OUTPUT_BUFFERS;
+    }
     if((r = OMX_SetParameter(ctx.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to set port definition for encoder output port 201");
     }
@@ -723,6 +1460,10 @@ int main(int argc, char **argv) {
 
     // Null sink input port definition is done automatically upon tunneling
 
+    // Ensure camera is ready, it has been getting ready
+    // while the other components were configured
+    block_until_camera_ready(&ctx, OMX_COMMAND_TIMEOUT);
+
     // Tunnel camera preview output port and null sink input port
     say("Setting up tunnel from camera preview output port 70 to null sink input port 240...");
     if((r = OMX_SetupTunnel(ctx.camera, 70, ctx.null_sink, 240)) != OMX_ErrorNone) {
@@ -735,49 +1476,66 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to setup tunnel between camera video output port 71 and encoder input port 200");
     }
 
+    // Write the encoded data straight to a pipe, files keep the writer ring
+    ctx.writer.direct_pipe = DIRECT_PIPE_OUTPUT && output_is_pipe(stdout);
+
+    // Size the encoder buffers and the writer ring to fit in the memory budget,
+    // the ring is planned in slots of one encoder buffer
+    ctx.writer_ring_size = WRITER_RING_SIZE;
+    if(MEMORY_BUDGET) {
+        buffer_plan plan[2];
+        memset(plan, 0, sizeof(plan));
+        init_port_plan(&plan[0], "encoder output port 201", ctx.encoder, 201);
+        plan[1].name = "writer ring";
+        plan[1].size = plan[0].size;
+        plan[1].count_min = 2;
+        plan[1].count_max = BUFFER_RING_SIZE;
+        // Output buffers are written to a pipe without the ring with DIRECT_PIPE_OUTPUT
+        plan_buffers(plan, ctx.writer.direct_pipe ? 1 : 2, MEMORY_BUDGET * 1024ULL * 1024ULL);
+        ctx.writer_ring_size = plan[1].size * plan[1].count;
+    }
+
+    end_phase(&phase_ns, "Startup", "configuration");
+
     // Switch components to idle state
     say("Switching state of the camera component to idle...");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to idle");
     }
-    block_until_state_changed(ctx.camera, OMX_StateIdle);
+    expect_command_complete(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateIdle);
     say("Switching state of the encoder component to idle...");
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the encoder component to idle");
     }
-    block_until_state_changed(ctx.encoder, OMX_StateIdle);
+    expect_command_complete(&ctx, ctx.encoder, OMX_CommandStateSet, OMX_StateIdle);
     say("Switching state of the null sink component to idle...");
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to idle");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
+    expect_command_complete(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle);
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "idle");
 
     // Enable ports
     say("Enabling ports...");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera input port 73");
     }
-    block_until_port_changed(ctx.camera, 73, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera preview output port 70");
     }
-    block_until_port_changed(ctx.camera, 70, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera video output port 71");
     }
-    block_until_port_changed(ctx.camera, 71, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandPortEnable, 200, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable encoder input port 200");
     }
-    block_until_port_changed(ctx.encoder, 200, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandPortEnable, 201, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable encoder output port 201");
     }
-    block_until_port_changed(ctx.encoder, 201, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortEnable, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable null sink input port 240");
     }
-    block_until_port_changed(ctx.null_sink, 240, OMX_TRUE);
 
     // Allocate camera input buffer and encoder output buffer,
     // buffers for tunneled ports are allocated internally by OMX
@@ -795,9 +1553,30 @@ int main(int argc, char **argv) {
     if((r = OMX_GetParameter(ctx.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for encoder output port 201");
     }
-    if((r = OMX_AllocateBuffer(ctx.encoder, &ctx.encoder_ppBuffer_out, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for encoder output port 201");
+    ctx.encoder_output_buffer_count = encoder_portdef.nBufferCountActual;
+    if(ctx.encoder_output_buffer_count > BUFFER_RING_SIZE) {
+        die("Encoder output buffer pool of %d buffers doesn't fit in the buffer ring", ctx.encoder_output_buffer_count);
+    }
+    ctx.encoder_ppBuffer_out = calloc(ctx.encoder_output_buffer_count, sizeof(OMX_BUFFERHEADERTYPE*));
+    if(!ctx.encoder_ppBuffer_out) {
+        die("Failed to allocate encoder output buffer pool of %d buffers", ctx.encoder_output_buffer_count);
     }
+    ctx.encoder_output_buffer_meta = alloc_buffer_meta(ctx.encoder_output_buffer_count);
+    for(i = 0; i < ctx.encoder_output_buffer_count; i++) {
+        if((r = OMX_AllocateBuffer(ctx.encoder, &ctx.encoder_ppBuffer_out[i], 201, &ctx.encoder_output_buffer_meta[i], encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to allocate buffer %d for encoder output port 201", i);
+        }
+    }
+    say("Allocated %d buffers of %d bytes for encoder output port 201", ctx.encoder_output_buffer_count, encoder_portdef.nBufferSize);
+
+    // Enabling a port completes only once it has been populated with buffers
+    block_until_port_changed(&ctx, ctx.camera, 73, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.camera, 70, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.camera, 71, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.encoder, 200, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.encoder, 201, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.null_sink, 240, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "port enable");
 
     // Just use stdout for output
     say("Opening output file...");
@@ -809,17 +1588,18 @@ int main(int argc, char **argv) {
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to executing");
     }
-    block_until_state_changed(ctx.camera, OMX_StateExecuting);
+    expect_command_complete(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateExecuting);
     say("Switching state of the encoder component to executing...");
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the encoder component to executing");
     }
-    block_until_state_changed(ctx.encoder, OMX_StateExecuting);
+    expect_command_complete(&ctx, ctx.encoder, OMX_CommandStateSet, OMX_StateExecuting);
     say("Switching state of the null sink component to executing...");
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to executing");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateExecuting);
+    expect_command_complete(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateExecuting);
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
 
     // Start capturing video with the camera
     say("Switching on capture on camera video output port 71...");
@@ -831,6 +1611,8 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to switch on capture on camera video output port 71");
     }
 
+    end_phase(&phase_ns, "Startup", "executing");
+
     say("Configured port definition for camera input port 73");
     dump_port(ctx.camera, 73, OMX_FALSE);
     say("Configured port definition for camera preview output port 70");
@@ -844,54 +1626,93 @@ int main(int argc, char **argv) {
     say("Configured port definition for null sink input port 240");
     dump_port(ctx.null_sink, 240, OMX_FALSE);
 
+    set_thread_scheduling("main", MAIN_THREAD_POLICY, MAIN_THREAD_PRIORITY, MAIN_THREAD_CPU);
+    jitter_stats jitter;
+    memset(&jitter, 0, sizeof(jitter));
+
     say("Enter capture and encode loop, press Ctrl-C to quit...");
 
-    int quit_detected = 0, quit_in_keyframe = 0, need_next_buffer_to_be_filled = 1;
-    size_t output_written;
+    int quit_detected = 0, quit_in_keyframe = 0, first_buffer = 1;
+    int frame_num = 1, slice_num = 0;
+    OMX_BUFFERHEADERTYPE *buffer;
 
+    quit_semaphore = &ctx.encoder_output_buffer_ready;
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGQUIT, signal_handler);
 
+    // Write the output file in a separate thread
+    output_writer_start(&ctx.writer, ctx.fd_out, ctx.encoder, ctx.writer_ring_size);
+
+    ctx.stats.loop_start_ns = get_time_ns();
+
+    // Hand all the output buffers to the encoder component,
+    // each one is requeued as soon as it has been flushed
+    for(i = 0; i < ctx.encoder_output_buffer_count; i++) {
+        mark_buffer_enqueued(ctx.encoder_ppBuffer_out[i]);
+        if((r = OMX_FillThisBuffer(ctx.encoder, ctx.encoder_ppBuffer_out[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer %d on encoder output port 201", i);
+        }
+    }
+
     while(1) {
-        // fill_output_buffer_done_handler() has marked that there's
-        // a buffer for us to flush
-        if(ctx.encoder_output_buffer_available) {
-            // Print a message if the user wants to quit, but don't exit
-            // the loop until we are certain that we have processed
-            // a full frame till end of the frame, i.e. we're at the end
-            // of the current key frame if processing one or until
-            // the next key frame is detected. This way we should always
-            // avoid corruption of the last encoded at the expense of
-            // small delay in exiting.
-            if(want_quit && !quit_detected) {
-                say("Exit signal detected, waiting for next key frame boundry before exiting...");
-                quit_detected = 1;
-                quit_in_keyframe = ctx.encoder_ppBuffer_out->nFlags & OMX_BUFFERFLAG_SYNCFRAME;
-            }
-            if(quit_detected && (quit_in_keyframe ^ (ctx.encoder_ppBuffer_out->nFlags & OMX_BUFFERFLAG_SYNCFRAME))) {
-                say("Key frame boundry reached, exiting loop...");
-                break;
-            }
-            // Flush buffer to output file
-            output_written = fwrite(ctx.encoder_ppBuffer_out->pBuffer + ctx.encoder_ppBuffer_out->nOffset, 1, ctx.encoder_ppBuffer_out->nFilledLen, ctx.fd_out);
-            if(output_written != ctx.encoder_ppBuffer_out->nFilledLen) {
-                die("Failed to write to output file: %s", strerror(errno));
-            }
-            say("Read from output buffer and wrote to output file %d/%d", ctx.encoder_ppBuffer_out->nFilledLen, ctx.encoder_ppBuffer_out->nAllocLen);
-            need_next_buffer_to_be_filled = 1;
+        // Sleep until fill_output_buffer_done_handler() signals
+        // that there's a buffer for us to flush
+        buffer = block_until_output_buffer_available(&ctx);
+        if(!buffer) {
+            say("No buffer from the encoder in %d ms, exiting loop...", OMX_COMMAND_TIMEOUT);
+            break;
         }
-        // Buffer flushed, request a new buffer to be filled by the encoder component
-        if(need_next_buffer_to_be_filled) {
-            need_next_buffer_to_be_filled = 0;
-            ctx.encoder_output_buffer_available = 0;
-            if((r = OMX_FillThisBuffer(ctx.encoder, ctx.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-                omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
-            }
+        // Print a message if the user wants to quit, but don't exit
+        // the loop until we are certain that we have processed
+        // a full frame till end of the frame, i.e. we're at the end
+        // of the current key frame if processing one or until
+        // the next key frame is detected. This way we should always
+        // avoid corruption of the last encoded at the expense of
+        // small delay in exiting.
+        if(want_quit && !quit_detected) {
+            say("Exit signal detected, waiting for next key frame boundry before exiting...");
+            quit_detected = 1;
+            quit_in_keyframe = buffer->nFlags & OMX_BUFFERFLAG_SYNCFRAME;
+        }
+        if(quit_detected && (quit_in_keyframe ^ (buffer->nFlags & OMX_BUFFERFLAG_SYNCFRAME))) {
+            say("Key frame boundry reached, exiting loop...");
+            break;
+        }
+        if(first_buffer) {
+            say("Startup to first encoded buffer took %.1f ms", (get_time_ns() - startup_ns) / 1e6);
+            first_buffer = 0;
+        }
+        BUFFER_META(buffer)->frame_index = frame_num;
+        BUFFER_META(buffer)->slice_index = slice_num++;
+        if(buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+            add_frame_arrival(&jitter);
+            frame_num++;
+            slice_num = 0;
+        }
+        say("Read from output buffer %d and queued for output file %d/%d, frame %d slice %d, timestamp %lld us, %.1f ms with the encoder, %.1f ms waiting to be queued",
+            BUFFER_META(buffer)->buffer_index, buffer->nFilledLen, buffer->nAllocLen,
+            BUFFER_META(buffer)->frame_index, BUFFER_META(buffer)->slice_index,
+            get_timestamp_us(BUFFER_META(buffer)->timestamp),
+            (BUFFER_META(buffer)->dequeue_ns - BUFFER_META(buffer)->enqueue_ns) / 1e6,
+            (get_time_ns() - BUFFER_META(buffer)->dequeue_ns) / 1e6);
+        if(ctx.writer.direct_pipe) {
+            // The writer thread requests the buffer to be filled again once written
+            output_writer_queue_buffer(&ctx.writer, buffer);
+            continue;
+        }
+        // Flush buffer to the writer thread
+        output_writer_queue(&ctx.writer, buffer->pBuffer + buffer->nOffset, buffer->nFilledLen);
+        // Buffer flushed, request it to be filled again by the encoder component
+        mark_buffer_enqueued(buffer);
+        if((r = OMX_FillThisBuffer(ctx.encoder, buffer)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
         }
-        // Would be better to use signaling here but hey this works too
-        usleep(1000);
     }
+    dump_loop_stats(&ctx.stats);
+    dump_jitter_stats(&jitter);
+    output_writer_stop(&ctx.writer);
+    dump_writer_stats(&ctx.writer);
     say("Cleaning up...");
 
     // Restore signal handlers
@@ -899,6 +1720,12 @@ int main(int argc, char **argv) {
     signal(SIGTERM, SIG_DFL);
     signal(SIGQUIT, SIG_DFL);
 
+    // Tear down all the components at once, all the steps
+    // together have to complete within TEARDOWN_TIMEOUT
+    unsigned long long teardown_ns = get_time_ns();
+    unsigned long long teardown_deadline_ns = teardown_ns + TEARDOWN_TIMEOUT * 1000000ULL;
+    phase_ns = teardown_ns;
+
     // Stop capturing video with the camera
     OMX_INIT_STRUCTURE(capture);
     capture.nPortIndex = 71;
@@ -907,97 +1734,116 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to switch off capture on camera video output port 71");
     }
 
-    // Return the last full buffer back to the encoder component
-    ctx.encoder_ppBuffer_out->nFlags = OMX_BUFFERFLAG_EOS;
-    if((r = OMX_FillThisBuffer(ctx.encoder, ctx.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+    // Return the last full buffer back to the encoder component, there is
+    // none if the loop gave up waiting for the encoder after the exit signal
+    if(buffer) {
+        buffer->nFlags = OMX_BUFFERFLAG_EOS;
+        mark_buffer_enqueued(buffer);
+        if((r = OMX_FillThisBuffer(ctx.encoder, buffer)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
+        }
     }
 
     // Flush the buffers on each component
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera input port 73");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 73);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera preview output port 70");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 70);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera video output port 71");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 71);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandFlush, 200, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of encoder input port 200");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandFlush, 200);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandFlush, 201, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of encoder output port 201");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandFlush, 201);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandFlush, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of null sink input port 240");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandFlush, 240);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "flush");
 
     // Disable all the ports
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera input port 73");
     }
-    block_until_port_changed(ctx.camera, 73, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 73);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera preview output port 70");
     }
-    block_until_port_changed(ctx.camera, 70, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 70);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera video output port 71");
     }
-    block_until_port_changed(ctx.camera, 71, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 71);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandPortDisable, 200, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable encoder input port 200");
     }
-    block_until_port_changed(ctx.encoder, 200, OMX_FALSE);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandPortDisable, 200);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandPortDisable, 201, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable encoder output port 201");
     }
-    block_until_port_changed(ctx.encoder, 201, OMX_FALSE);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandPortDisable, 201);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortDisable, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable null sink input port 240");
     }
-    block_until_port_changed(ctx.null_sink, 240, OMX_FALSE);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandPortDisable, 240);
 
     // Free all the buffers
     if((r = OMX_FreeBuffer(ctx.camera, 73, ctx.camera_ppBuffer_in)) != OMX_ErrorNone) {
         omx_die(r, "Failed to free buffer for camera input port 73");
     }
-    if((r = OMX_FreeBuffer(ctx.encoder, 201, ctx.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for encoder output port 201");
+    for(i = 0; i < ctx.encoder_output_buffer_count; i++) {
+        if((r = OMX_FreeBuffer(ctx.encoder, 201, ctx.encoder_ppBuffer_out[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to free buffer %d for encoder output port 201", i);
+        }
     }
+    free(ctx.encoder_ppBuffer_out);
+    free(ctx.encoder_output_buffer_meta);
+
+    // Disabling a port completes only once its buffers have been freed
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "disable");
 
-    // Transition all the components to idle and then to loaded states
+    // Transition all the components to idle and then to loaded states,
+    // all of them are idle before any of them is switched to loaded
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to idle");
     }
-    block_until_state_changed(ctx.camera, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateIdle);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the encoder component to idle");
     }
-    block_until_state_changed(ctx.encoder, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandStateSet, OMX_StateIdle);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to idle");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "idle");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to loaded");
     }
-    block_until_state_changed(ctx.camera, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateLoaded);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the encoder component to loaded");
     }
-    block_until_state_changed(ctx.encoder, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandStateSet, OMX_StateLoaded);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to loaded");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "loaded");
 
     // Free the component handles
     if((r = OMX_FreeHandle(ctx.camera)) != OMX_ErrorNone) {
@@ -1009,11 +1855,15 @@ int main(int argc, char **argv) {
     if((r = OMX_FreeHandle(ctx.null_sink)) != OMX_ErrorNone) {
         omx_die(r, "Failed to free null sink component handle");
     }
+    end_phase(&phase_ns, "Teardown", "free handles");
+    say("Teardown took %.1f ms", (get_time_ns() - teardown_ns) / 1e6);
 
     // Exit
     fclose(ctx.fd_out);
 
-    vcos_semaphore_delete(&ctx.handler_lock);
+    vcos_semaphore_delete(&ctx.encoder_output_buffer_ready);
+    pthread_cond_destroy(&ctx.command_cond);
+    pthread_mutex_destroy(&ctx.command_lock);
     if((r = OMX_Deinit()) != OMX_ErrorNone) {
         omx_die(r, "OMX de-initalization failed");
     }
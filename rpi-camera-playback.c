@@ -38,6 +38,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <bcm_host.h>
 
@@ -66,6 +68,9 @@
 #define CAM_FLIP_HORIZONTAL             OMX_FALSE
 #define CAM_FLIP_VERTICAL               OMX_FALSE
 #define DISPLAY_DEVICE                  0
+#define CONCURRENT_BRINGUP              1                       // 0 waits for each startup command in turn
+#define OMX_COMMAND_TIMEOUT             2000                    // ms
+#define TEARDOWN_TIMEOUT                1000                    // ms, for the whole teardown
 
 // Dunno where this is originally stolen from...
 #define OMX_INIT_STRUCTURE(a) \
@@ -80,6 +85,18 @@
 // Global variable used by the signal handler and capture/encoding loop
 static int want_quit = 0;
 
+// OMX_EventCmdComplete event received by the event handler
+// but not yet waited for by the main routine
+#define MAX_COMMAND_EVENTS 32
+typedef struct {
+    OMX_HANDLETYPE hComponent;
+    OMX_U32 nCommand;
+    OMX_U32 nData2;
+} omx_command_event;
+
+// Commands sent to the components but not yet waited for
+#define MAX_PENDING_COMMANDS 32
+
 // Our application context passed around
 // the main routine and callback handlers
 typedef struct {
@@ -88,8 +105,12 @@ typedef struct {
     int camera_ready;
     OMX_HANDLETYPE render;
     OMX_HANDLETYPE null_sink;
-    int flushed;
-    VCOS_SEMAPHORE_T handler_lock;
+    omx_command_event command_events[MAX_COMMAND_EVENTS];
+    int command_events_count;
+    omx_command_event pending_commands[MAX_PENDING_COMMANDS];
+    int pending_commands_count;
+    pthread_mutex_t command_lock;
+    pthread_cond_t command_cond;
 } appctx;
 
 // Ugly, stupid utility functions
@@ -118,6 +139,12 @@ static void die(const char* message, ...) {
     exit(1);
 }
 
+static unsigned long long get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static void omx_die(OMX_ERRORTYPE error, const char* message, ...) {
     va_list args;
     char str[1024];
@@ -331,47 +358,110 @@ static void dump_port(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL du
     }
 }
 
-// Some busy loops to verify we're running in order
-static void block_until_state_changed(OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState) {
-    OMX_STATETYPE eState;
-    int i = 0;
-    while(i++ == 0 || eState != wanted_eState) {
-        OMX_GetState(hComponent, &eState);
-        if(eState != wanted_eState) {
-            usleep(10000);
-        }
-    }
+// Convert a timeout relative to now to an absolute
+// CLOCK_MONOTONIC deadline for pthread_cond_timedwait()
+static void get_deadline(int timeout_ms, struct timespec *deadline) {
+    unsigned long long deadline_ns = get_time_ns() + timeout_ms * 1000000ULL;
+    deadline->tv_sec  = deadline_ns / 1000000000ULL;
+    deadline->tv_nsec = deadline_ns % 1000000000ULL;
 }
 
-static void block_until_port_changed(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled) {
-    OMX_ERRORTYPE r;
-    OMX_PARAM_PORTDEFINITIONTYPE portdef;
-    OMX_INIT_STRUCTURE(portdef);
-    portdef.nPortIndex = nPortIndex;
-    OMX_U32 i = 0;
-    while(i++ == 0 || portdef.bEnabled != bEnabled) {
-        if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
-            omx_die(r, "Failed to get port definition");
+// Wait until the event handler has received OMX_EventCmdComplete
+// for the given command, returns -1 if timeout_ms elapsed before that
+static int wait_for_command_complete(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2, int timeout_ms) {
+    struct timespec deadline;
+    int i, found = 0, timed_out = 0;
+    get_deadline(timeout_ms, &deadline);
+    pthread_mutex_lock(&ctx->command_lock);
+    while(1) {
+        for(i = 0; i < ctx->command_events_count; i++) {
+            omx_command_event *e = &ctx->command_events[i];
+            if(e->hComponent == hComponent && e->nCommand == nCommand && e->nData2 == nData2) {
+                // Consume the event so that it won't satisfy a later wait
+                *e = ctx->command_events[--ctx->command_events_count];
+                found = 1;
+                break;
+            }
         }
-        if(portdef.bEnabled != bEnabled) {
-            usleep(10000);
+        if(found || timed_out) {
+            break;
         }
+        timed_out = pthread_cond_timedwait(&ctx->command_cond, &ctx->command_lock, &deadline) == ETIMEDOUT;
     }
+    pthread_mutex_unlock(&ctx->command_lock);
+    return found ? 0 : -1;
 }
 
-static void block_until_flushed(appctx *ctx) {
-    int quit;
-    while(!quit) {
-        vcos_semaphore_wait(&ctx->handler_lock);
-        if(ctx->flushed) {
-            ctx->flushed = 0;
-            quit = 1;
-        }
-        vcos_semaphore_post(&ctx->handler_lock);
-        if(!quit) {
-            usleep(10000);
+// Some blocking waits to verify we're running in order
+static void block_until_port_changed(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled, int timeout_ms) {
+    OMX_COMMANDTYPE nCommand = bEnabled ? OMX_CommandPortEnable : OMX_CommandPortDisable;
+    if(wait_for_command_complete(ctx, hComponent, nCommand, nPortIndex, timeout_ms) != 0) {
+        die("Timed out after %d ms waiting for port %d of component 0x%08x to be %s",
+            timeout_ms, nPortIndex, hComponent, bEnabled ? "enabled" : "disabled");
+    }
+}
+
+// Milliseconds left until the deadline, 0 if it has already passed
+static int get_remaining_ms(unsigned long long deadline_ns) {
+    unsigned long long now_ns = get_time_ns();
+    return now_ns < deadline_ns ? (deadline_ns - now_ns + 999999ULL) / 1000000ULL : 0;
+}
+
+// Wait for all the pending commands at once. They are carried out
+// concurrently by the components, so they share a single deadline.
+static void block_until_commands_complete(appctx *ctx, int timeout_ms) {
+    unsigned long long deadline_ns = get_time_ns() + timeout_ms * 1000000ULL;
+    int i;
+    for(i = 0; i < ctx->pending_commands_count; i++) {
+        omx_command_event *e = &ctx->pending_commands[i];
+        if(wait_for_command_complete(ctx, e->hComponent, e->nCommand, e->nData2, get_remaining_ms(deadline_ns)) != 0) {
+            die("Timed out after %d ms waiting for component 0x%08x to complete command %d for %d",
+                timeout_ms, e->hComponent, e->nCommand, e->nData2);
         }
     }
+    ctx->pending_commands_count = 0;
+}
+
+// Remember a command sent to a component so that it can be waited for
+// together with the others by block_until_commands_complete()
+static void add_pending_command(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2) {
+    if(ctx->pending_commands_count == MAX_PENDING_COMMANDS) {
+        die("Too many pending commands");
+    }
+    omx_command_event *e = &ctx->pending_commands[ctx->pending_commands_count++];
+    e->hComponent = hComponent;
+    e->nCommand = nCommand;
+    e->nData2 = nData2;
+}
+
+// Same for a startup command, which is waited for
+// right away without CONCURRENT_BRINGUP
+static void expect_command_complete(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2) {
+    add_pending_command(ctx, hComponent, nCommand, nData2);
+    if(!CONCURRENT_BRINGUP) {
+        block_until_commands_complete(ctx, OMX_COMMAND_TIMEOUT);
+    }
+}
+
+// Log the time spent in a startup or teardown phase and start timing the next one
+static void end_phase(unsigned long long *phase_start_ns, const char *sequence, const char *phase) {
+    unsigned long long now_ns = get_time_ns();
+    say("%s phase %s took %.1f ms", sequence, phase, (now_ns - *phase_start_ns) / 1e6);
+    *phase_start_ns = now_ns;
+}
+
+static void block_until_camera_ready(appctx *ctx, int timeout_ms) {
+    struct timespec deadline;
+    int timed_out = 0;
+    get_deadline(timeout_ms, &deadline);
+    pthread_mutex_lock(&ctx->command_lock);
+    while(!ctx->camera_ready && !timed_out) {
+        timed_out = pthread_cond_timedwait(&ctx->command_cond, &ctx->command_lock, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&ctx->command_lock);
+    if(!ctx->camera_ready) {
+        die("Timed out after %d ms waiting for the camera to become ready", timeout_ms);
+    }
 }
 
 static void init_component_handle(
@@ -411,7 +501,7 @@ static void init_component_handle(
                 if((r = OMX_SendCommand(*hComponent, OMX_CommandPortDisable, nPortIndex, NULL)) != OMX_ErrorNone) {
                     omx_die(r, "Failed to disable port %d of component %s", nPortIndex, fullname);
                 }
-                block_until_port_changed(*hComponent, nPortIndex, OMX_FALSE);
+                expect_command_complete((appctx *)pAppData, *hComponent, OMX_CommandPortDisable, nPortIndex);
             }
         }
     }
@@ -437,18 +527,25 @@ static OMX_ERRORTYPE event_handler(
 
     switch(eEvent) {
         case OMX_EventCmdComplete:
-            vcos_semaphore_wait(&ctx->handler_lock);
-            if(nData1 == OMX_CommandFlush) {
-                ctx->flushed = 1;
+            // Record the event for wait_for_command_complete()
+            pthread_mutex_lock(&ctx->command_lock);
+            if(ctx->command_events_count == MAX_COMMAND_EVENTS) {
+                die("Too many command complete events pending");
             }
-            vcos_semaphore_post(&ctx->handler_lock);
+            ctx->command_events[ctx->command_events_count].hComponent = hComponent;
+            ctx->command_events[ctx->command_events_count].nCommand   = nData1;
+            ctx->command_events[ctx->command_events_count].nData2     = nData2;
+            ctx->command_events_count++;
+            pthread_cond_broadcast(&ctx->command_cond);
+            pthread_mutex_unlock(&ctx->command_lock);
             break;
         case OMX_EventParamOrConfigChanged:
-            vcos_semaphore_wait(&ctx->handler_lock);
+            pthread_mutex_lock(&ctx->command_lock);
             if(nData2 == OMX_IndexParamCameraDeviceNumber) {
                 ctx->camera_ready = 1;
+                pthread_cond_broadcast(&ctx->command_cond);
             }
-            vcos_semaphore_post(&ctx->handler_lock);
+            pthread_mutex_unlock(&ctx->command_lock);
             break;
         case OMX_EventError:
             omx_die(nData1, "error event received");
@@ -461,6 +558,8 @@ static OMX_ERRORTYPE event_handler(
 }
 
 int main(int argc, char **argv) {
+    unsigned long long startup_ns = get_time_ns(), phase_ns = startup_ns;
+
     bcm_host_init();
 
     OMX_ERRORTYPE r;
@@ -472,18 +571,25 @@ int main(int argc, char **argv) {
     // Init context
     appctx ctx;
     memset(&ctx, 0, sizeof(ctx));
-    if(vcos_semaphore_create(&ctx.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
-        die("Failed to create handler lock semaphore");
+    pthread_condattr_t command_cond_attr;
+    pthread_condattr_init(&command_cond_attr);
+    pthread_condattr_setclock(&command_cond_attr, CLOCK_MONOTONIC);
+    if(pthread_mutex_init(&ctx.command_lock, NULL) != 0 || pthread_cond_init(&ctx.command_cond, &command_cond_attr) != 0) {
+        die("Failed to create command completion lock");
     }
+    pthread_condattr_destroy(&command_cond_attr);
 
     // Init component handles
     OMX_CALLBACKTYPE callbacks;
-    memset(&ctx, 0, sizeof(callbacks));
+    memset(&callbacks, 0, sizeof(callbacks));
     callbacks.EventHandler = event_handler;
 
     init_component_handle("camera", &ctx.camera , &ctx, &callbacks);
     init_component_handle("video_render", &ctx.render, &ctx, &callbacks);
     init_component_handle("null_sink", &ctx.null_sink, &ctx, &callbacks);
+    // Wait for the ports of all the components to be disabled at once
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "component handles");
 
     OMX_U32 screen_width = 0, screen_height = 0;
     if(graphics_get_display_size(DISPLAY_DEVICE, &screen_width, &screen_height) < 0) {
@@ -640,11 +746,6 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to set mirror configuration for camera video output port 71");
     }
 
-    // Ensure camera is ready
-    while(!ctx.camera_ready) {
-        usleep(10000);
-    }
-
     say("Configuring render...");
 
     say("Default port definition for render input port 90");
@@ -675,6 +776,10 @@ int main(int argc, char **argv) {
 
     // Null sink input port definition is done automatically upon tunneling
 
+    // Ensure camera is ready, it has been getting ready
+    // while the other components were configured
+    block_until_camera_ready(&ctx, OMX_COMMAND_TIMEOUT);
+
     // Tunnel camera preview output port and null sink input port
     say("Setting up tunnel from camera preview output port 70 to null sink input port 240...");
     if((r = OMX_SetupTunnel(ctx.camera, 70, ctx.null_sink, 240)) != OMX_ErrorNone) {
@@ -687,45 +792,44 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to setup tunnel between camera video output port 71 and render input port 90");
     }
 
+    end_phase(&phase_ns, "Startup", "configuration");
+
     // Switch components to idle state
     say("Switching state of the camera component to idle...");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to idle");
     }
-    block_until_state_changed(ctx.camera, OMX_StateIdle);
+    expect_command_complete(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateIdle);
     say("Switching state of the render component to idle...");
     if((r = OMX_SendCommand(ctx.render, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the render component to idle");
     }
-    block_until_state_changed(ctx.render, OMX_StateIdle);
+    expect_command_complete(&ctx, ctx.render, OMX_CommandStateSet, OMX_StateIdle);
     say("Switching state of the null sink component to idle...");
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to idle");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
+    expect_command_complete(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle);
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "idle");
 
     // Enable ports
     say("Enabling ports...");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera input port 73");
     }
-    block_until_port_changed(ctx.camera, 73, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera preview output port 70");
     }
-    block_until_port_changed(ctx.camera, 70, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortEnable, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable camera video output port 71");
     }
-    block_until_port_changed(ctx.camera, 71, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.render, OMX_CommandPortEnable, 90, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable render input port 90");
     }
-    block_until_port_changed(ctx.render, 90, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortEnable, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable null sink input port 240");
     }
-    block_until_port_changed(ctx.null_sink, 240, OMX_TRUE);
 
     // Allocate camera input buffer, buffers for tunneled
     // ports are allocated internally by OMX
@@ -739,23 +843,32 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to allocate buffer for camera input port 73");
     }
 
+    // Enabling a port completes only once it has been populated with buffers
+    block_until_port_changed(&ctx, ctx.camera, 73, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.camera, 70, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.camera, 71, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.render, 90, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.null_sink, 240, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "port enable");
+
     // Switch state of the components prior to starting
     // the video capture and encoding loop
     say("Switching state of the camera component to executing...");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to executing");
     }
-    block_until_state_changed(ctx.camera, OMX_StateExecuting);
+    expect_command_complete(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateExecuting);
     say("Switching state of the render component to executing...");
     if((r = OMX_SendCommand(ctx.render, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the render component to executing");
     }
-    block_until_state_changed(ctx.render, OMX_StateExecuting);
+    expect_command_complete(&ctx, ctx.render, OMX_CommandStateSet, OMX_StateExecuting);
     say("Switching state of the null sink component to executing...");
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to executing");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateExecuting);
+    expect_command_complete(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateExecuting);
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
 
     // Start capturing video with the camera
     say("Switching on capture on camera video output port 71...");
@@ -767,6 +880,8 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to switch on capture on camera video output port 71");
     }
 
+    end_phase(&phase_ns, "Startup", "executing");
+
     say("Configured port definition for camera input port 73");
     dump_port(ctx.camera, 73, OMX_FALSE);
     say("Configured port definition for camera preview output port 70");
@@ -778,6 +893,7 @@ int main(int argc, char **argv) {
     say("Configured port definition for null sink input port 240");
     dump_port(ctx.null_sink, 240, OMX_FALSE);
 
+    say("Startup took %.1f ms", (get_time_ns() - startup_ns) / 1e6);
     say("Enter capture and playback loop, press Ctrl-C to quit...");
 
     signal(SIGINT,  signal_handler);
@@ -795,6 +911,12 @@ int main(int argc, char **argv) {
     signal(SIGTERM, SIG_DFL);
     signal(SIGQUIT, SIG_DFL);
 
+    // Tear down all the components at once, all the steps
+    // together have to complete within TEARDOWN_TIMEOUT
+    unsigned long long teardown_ns = get_time_ns();
+    unsigned long long teardown_deadline_ns = teardown_ns + TEARDOWN_TIMEOUT * 1000000ULL;
+    phase_ns = teardown_ns;
+
     // Stop capturing video with the camera
     OMX_INIT_STRUCTURE(capture);
     capture.nPortIndex = 71;
@@ -807,75 +929,87 @@ int main(int argc, char **argv) {
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera input port 73");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 73);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera preview output port 70");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 70);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandFlush, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of camera video output port 71");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandFlush, 71);
     if((r = OMX_SendCommand(ctx.render, OMX_CommandFlush, 90, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of render input port 90");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.render, OMX_CommandFlush, 90);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandFlush, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of null sink input port 240");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandFlush, 240);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "flush");
 
     // Disable all the ports
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 73, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera input port 73");
     }
-    block_until_port_changed(ctx.camera, 73, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 73);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 70, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera preview output port 70");
     }
-    block_until_port_changed(ctx.camera, 70, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 70);
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandPortDisable, 71, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable camera video output port 71");
     }
-    block_until_port_changed(ctx.camera, 71, OMX_FALSE);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandPortDisable, 71);
     if((r = OMX_SendCommand(ctx.render, OMX_CommandPortDisable, 90, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable render input port 90");
     }
+    add_pending_command(&ctx, ctx.render, OMX_CommandPortDisable, 90);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandPortDisable, 240, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable null sink input port 240");
     }
-    block_until_port_changed(ctx.null_sink, 240, OMX_FALSE);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandPortDisable, 240);
 
     // Free all the buffers
     if((r = OMX_FreeBuffer(ctx.camera, 73, ctx.camera_ppBuffer_in)) != OMX_ErrorNone) {
         omx_die(r, "Failed to free buffer for camera input port 73");
     }
 
-    // Transition all the components to idle and then to loaded states
+    // Disabling a port completes only once its buffers have been freed
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "disable");
+
+    // Transition all the components to idle and then to loaded states,
+    // all of them are idle before any of them is switched to loaded
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to idle");
     }
-    block_until_state_changed(ctx.camera, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateIdle);
     if((r = OMX_SendCommand(ctx.render, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the render component to idle");
     }
-    block_until_state_changed(ctx.render, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.render, OMX_CommandStateSet, OMX_StateIdle);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to idle");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateIdle);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "idle");
     if((r = OMX_SendCommand(ctx.camera, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the camera component to loaded");
     }
-    block_until_state_changed(ctx.camera, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.camera, OMX_CommandStateSet, OMX_StateLoaded);
     if((r = OMX_SendCommand(ctx.render, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the render component to loaded");
     }
-    block_until_state_changed(ctx.render, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.render, OMX_CommandStateSet, OMX_StateLoaded);
     if((r = OMX_SendCommand(ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the null sink component to loaded");
     }
-    block_until_state_changed(ctx.null_sink, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.null_sink, OMX_CommandStateSet, OMX_StateLoaded);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "loaded");
 
     // Free the component handles
     if((r = OMX_FreeHandle(ctx.camera)) != OMX_ErrorNone) {
@@ -887,9 +1021,12 @@ int main(int argc, char **argv) {
     if((r = OMX_FreeHandle(ctx.null_sink)) != OMX_ErrorNone) {
         omx_die(r, "Failed to free null sink component handle");
     }
+    end_phase(&phase_ns, "Teardown", "free handles");
+    say("Teardown took %.1f ms", (get_time_ns() - teardown_ns) / 1e6);
 
     // Exit
-    vcos_semaphore_delete(&ctx.handler_lock);
+    pthread_cond_destroy(&ctx.command_cond);
+    pthread_mutex_destroy(&ctx.command_lock);
     if((r = OMX_Deinit()) != OMX_ErrorNone) {
         omx_die(r, "OMX de-initalization failed");
     }
@@ -31,12 +31,21 @@
  *
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
 
 #include <bcm_host.h>
 
@@ -53,6 +62,26 @@
 #define VIDEO_HEIGHT                    1080 / 4
 #define VIDEO_FRAMERATE                 25
 #define VIDEO_BITRATE                   10000000
+#define ENCODER_INPUT_BUFFERS           4                       // read-ahead depth, at least nBufferCountActual of port 200
+#define ENCODER_OUTPUT_BUFFERS          8                       // at least nBufferCountActual of port 201
+#define MEMORY_BUDGET                   0                       // MB for port buffers and rings, 0 uses the counts above
+#define INPUT_READER_THREAD             1                       // 0 reads input in the encode loop
+#define INPUT_MMAP                      1                       // 0 reads a regular input file with fread()
+#define MAIN_THREAD_POLICY              SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define MAIN_THREAD_PRIORITY            0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define MAIN_THREAD_CPU                 -1                      // -1 doesn't pin the thread
+#define READER_THREAD_POLICY            SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define READER_THREAD_PRIORITY          0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define READER_THREAD_CPU               -1                      // -1 doesn't pin the thread
+#define CALLBACK_THREAD_POLICY          SCHED_OTHER             // SCHED_OTHER, SCHED_FIFO or SCHED_RR
+#define CALLBACK_THREAD_PRIORITY        0                       // 1 .. 99 with SCHED_FIFO and SCHED_RR
+#define CALLBACK_THREAD_CPU             -1                      // -1 doesn't pin the thread
+#define LOCKED_FRAME_MEMORY             0                       // 1 maps frame memory from huge pages and locks it
+#define HUGE_PAGE_SIZE                  (2 * 1024 * 1024)
+#define JITTER_LOG_THRESHOLD            5                       // ms
+#define CONCURRENT_BRINGUP              1                       // 0 waits for each startup command in turn
+#define OMX_COMMAND_TIMEOUT             2000                    // ms
+#define TEARDOWN_TIMEOUT                1000                    // ms, for the whole teardown
 
 // Dunno where this is originally stolen from...
 #define OMX_INIT_STRUCTURE(a) \
@@ -66,21 +95,116 @@
 
 // Global variable used by the signal handler and encoding loop
 static int want_quit = 0;
+// Posted by the signal handler to wake up the encoding loop and the
+// reader thread, which may be waiting for buffers that never come
+static VCOS_SEMAPHORE_T *quit_semaphores[2];
+
+// OMX_EventCmdComplete event received by the event handler
+// but not yet waited for by the main routine
+#define MAX_COMMAND_EVENTS 32
+typedef struct {
+    OMX_HANDLETYPE hComponent;
+    OMX_U32 nCommand;
+    OMX_U32 nData2;
+} omx_command_event;
+
+// Commands sent to the components but not yet waited for
+#define MAX_PENDING_COMMANDS 32
+
+// Single producer, single consumer ring of buffer headers passed from an OMX
+// callback to the main loop without locking. Only the producer writes head
+// and only the consumer writes tail. It must have room for all the buffers
+// of the port so that pushing never fails.
+#define BUFFER_RING_SIZE 32 // power of two
+typedef struct {
+    OMX_BUFFERHEADERTYPE *buffers[BUFFER_RING_SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+} buffer_ring;
+
+// Metadata of a buffer, preallocated in one slab for all the buffers of a
+// port and attached to the buffer header with pAppPrivate
+typedef struct {
+    int buffer_index;
+    unsigned int sequence;          // times the component has returned the buffer
+    OMX_TICKS timestamp;            // nTimeStamp when last returned
+    OMX_U32 flags;                  // nFlags when last returned
+    unsigned long long enqueue_ns;  // when last handed to the component
+    unsigned long long dequeue_ns;  // when last returned by the component
+    int frame_index;
+    int slice_index;
+} buffer_meta;
+
+#define BUFFER_META(buffer) ((buffer_meta*)(buffer)->pAppPrivate)
+
+// A pool of port buffers or ring slots sized by plan_buffers(). Port
+// buffer pools have the component and the port set.
+typedef struct {
+    const char *name;
+    OMX_HANDLETYPE component;
+    OMX_U32 port;
+    size_t size;        // bytes per buffer
+    int count_min;
+    int count_max;
+    int count;
+} buffer_plan;
 
 // Our application context passed around
 // the main routine and callback handlers
 typedef struct {
     OMX_HANDLETYPE encoder;
-    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_in;
-    OMX_BUFFERHEADERTYPE *encoder_ppBuffer_out;
-    int encoder_input_buffer_needed;
-    int encoder_output_buffer_available;
-    int flushed;
+    OMX_BUFFERHEADERTYPE **encoder_ppBuffer_in;
+    buffer_meta *encoder_input_buffer_meta;
+    int encoder_input_buffer_count;
+    OMX_BUFFERHEADERTYPE **encoder_ppBuffer_out;
+    buffer_meta *encoder_output_buffer_meta;
+    int encoder_output_buffer_count;
+    buffer_ring encoder_input_buffers_emptied;
+    buffer_ring encoder_input_buffers_read;
+    buffer_ring encoder_output_buffers_filled;
+    // Posted by the buffer done handlers and the reader thread to wake up the main loop
+    VCOS_SEMAPHORE_T buffer_done;
+    // Posted by empty_input_buffer_done_handler() to wake up the reader thread
+    VCOS_SEMAPHORE_T input_buffer_emptied;
+    // Set by the reader thread once it has read all the input
+    volatile int input_eof;
+    int frames_read;
+    unsigned long long read_ns;
+    unsigned long long bytes_cleared;
     FILE *fd_in;
+    // Set when the input is a regular file mapped as a whole with mmap()
+    int input_mmap;
+    const unsigned char *input_map;
+    // Set when the input buffers are our own, registered with OMX_UseBuffer()
+    int input_own_buffers;
+    // Set when the frames of the input file have the layout of the input buffers
+    int input_same_layout;
+    off_t input_size;
+    off_t input_offset;
+    unsigned char *encoder_input_memory;
+    size_t encoder_input_memory_mapped_size;
+    int frames_copied_whole;
     FILE *fd_out;
-    VCOS_SEMAPHORE_T handler_lock;
+    omx_command_event command_events[MAX_COMMAND_EVENTS];
+    int command_events_count;
+    omx_command_event pending_commands[MAX_PENDING_COMMANDS];
+    int pending_commands_count;
+    pthread_mutex_t command_lock;
+    pthread_cond_t command_cond;
 } appctx;
 
+// Frame to frame jitter as seen by the main loop, i.e. how much the interval
+// between two frames differs from the interval between the previous two
+typedef struct {
+    unsigned int frames;
+    unsigned long long last_ns;
+    unsigned long long last_interval_ns;
+    unsigned int samples;
+    unsigned int over_threshold;
+    unsigned long long sum_ns;
+    unsigned long long max_ns;
+} jitter_stats;
+
 // I420 frame stuff
 typedef struct {
     int width;
@@ -93,6 +217,14 @@ typedef struct {
     int p_stride[3];
 } i420_frame_info;
 
+// Reads input frames ahead of the encoder in a separate thread
+typedef struct {
+    appctx *ctx;
+    i420_frame_info frame_info;
+    i420_frame_info buf_info;
+    pthread_t thread;
+} input_reader;
+
 // Stolen from video-info.c of gstreamer-plugins-base
 #define ROUND_UP_2(num) (((num)+1)&~1)
 #define ROUND_UP_4(num) (((num)+3)&~3)
@@ -142,6 +274,164 @@ static void die(const char* message, ...) {
     exit(1);
 }
 
+static unsigned long long get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Apply the scheduling policy, priority and CPU affinity configured
+// for a thread role to the calling thread. Failing to do so, e.g. for
+// the lack of privileges for real-time scheduling, isn't fatal.
+static void set_thread_scheduling(const char *role, int policy, int priority, int cpu) {
+    struct sched_param param;
+    cpu_set_t cpus;
+    int r;
+    say("Scheduling the %s thread with policy %d, priority %d, CPU %d", role, policy, priority, cpu);
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if((r = pthread_setschedparam(pthread_self(), policy, &param)) != 0) {
+        say("Failed to set scheduling policy of the %s thread: %s", role, strerror(r));
+    }
+    if(cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if((r = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus)) != 0) {
+            say("Failed to set CPU affinity of the %s thread: %s", role, strerror(r));
+        }
+    }
+}
+
+// OMX calls the handlers from its own thread, so the settings
+// are applied by the first handler called in that thread
+static __thread int callback_thread_configured = 0;
+static void configure_callback_thread(void) {
+    if(!callback_thread_configured) {
+        callback_thread_configured = 1;
+        set_thread_scheduling("OMX callback", CALLBACK_THREAD_POLICY, CALLBACK_THREAD_PRIORITY, CALLBACK_THREAD_CPU);
+    }
+}
+
+// Allocates the metadata of all the buffers of a port at once
+static buffer_meta *alloc_buffer_meta(int count) {
+    buffer_meta *meta = calloc(count, sizeof(buffer_meta));
+    int i;
+    if(!meta) {
+        die("Failed to allocate metadata for %d buffers", count);
+    }
+    for(i = 0; i < count; i++) {
+        meta[i].buffer_index = i;
+    }
+    return meta;
+}
+
+// Called right before the buffer is handed to the component
+static void mark_buffer_enqueued(OMX_BUFFERHEADERTYPE *buffer) {
+    BUFFER_META(buffer)->enqueue_ns = get_time_ns();
+}
+
+// Called by the buffer done handlers when the component returns the buffer
+static void mark_buffer_dequeued(OMX_BUFFERHEADERTYPE *buffer) {
+    buffer_meta *meta = BUFFER_META(buffer);
+    meta->dequeue_ns = get_time_ns();
+    meta->timestamp = buffer->nTimeStamp;
+    meta->flags = buffer->nFlags;
+    meta->sequence++;
+}
+
+static long long get_timestamp_us(OMX_TICKS ticks) {
+#ifdef OMX_SKIP64BIT
+    return ((long long)ticks.nHighPart << 32) | ticks.nLowPart;
+#else
+    return ticks;
+#endif
+}
+
+// Allocates memory for frames. With LOCKED_FRAME_MEMORY the memory is mapped
+// from huge pages, or from transparent huge pages if there are none, and
+// locked so that it is neither paged out nor faulted in while capturing.
+// The memory is page aligned. Sets mapped_size to the size of the mapping,
+// 0 if the memory was allocated with posix_memalign().
+static void *alloc_frame_memory(size_t size, size_t *mapped_size) {
+    void *memory;
+    *mapped_size = 0;
+    if(!LOCKED_FRAME_MEMORY) {
+        return posix_memalign(&memory, sysconf(_SC_PAGESIZE), size) == 0 ? memory : NULL;
+    }
+    *mapped_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+    memory = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if(memory == MAP_FAILED) {
+        say("Failed to map %zu bytes of frame memory from huge pages, using transparent huge pages: %s", *mapped_size, strerror(errno));
+        memory = mmap(NULL, *mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED) {
+            die("Failed to map %zu bytes of frame memory: %s", *mapped_size, strerror(errno));
+        }
+        if(madvise(memory, *mapped_size, MADV_HUGEPAGE) != 0) {
+            say("Failed to enable transparent huge pages for frame memory: %s", strerror(errno));
+        }
+    }
+    // Also faults in all the pages up front
+    if(mlock(memory, *mapped_size) != 0) {
+        say("Failed to lock %zu bytes of frame memory, it may be paged out: %s", *mapped_size, strerror(errno));
+    }
+    return memory;
+}
+
+static void free_frame_memory(void *memory, size_t mapped_size) {
+    if(mapped_size) {
+        munlock(memory, mapped_size);
+        munmap(memory, mapped_size);
+    } else {
+        free(memory);
+    }
+}
+
+// Page faults of the process so far, read at the start and at the end of the loop
+static void get_page_faults(long *minor, long *major) {
+    struct rusage usage;
+    if(getrusage(RUSAGE_SELF, &usage) != 0) {
+        *minor = *major = -1;
+        return;
+    }
+    *minor = usage.ru_minflt;
+    *major = usage.ru_majflt;
+}
+
+// Called by the main loop for each frame
+static void add_frame_arrival(jitter_stats *jitter) {
+    unsigned long long now_ns = get_time_ns(), interval_ns, jitter_ns;
+    jitter->frames++;
+    if(jitter->last_ns) {
+        interval_ns = now_ns - jitter->last_ns;
+        if(jitter->last_interval_ns) {
+            jitter_ns = interval_ns > jitter->last_interval_ns
+                ? interval_ns - jitter->last_interval_ns
+                : jitter->last_interval_ns - interval_ns;
+            jitter->samples++;
+            jitter->sum_ns += jitter_ns;
+            if(jitter_ns > jitter->max_ns) {
+                jitter->max_ns = jitter_ns;
+            }
+            if(jitter_ns > JITTER_LOG_THRESHOLD * 1000000ULL) {
+                jitter->over_threshold++;
+                say("Frame %d arrived with %.1f ms jitter", jitter->frames, jitter_ns / 1e6);
+            }
+        }
+        jitter->last_interval_ns = interval_ns;
+    }
+    jitter->last_ns = now_ns;
+}
+
+static void dump_jitter_stats(const jitter_stats *jitter) {
+    say("Frame jitter:\n"
+        "\tAverage:\t\t%.1f us\n"
+        "\tMax:\t\t\t%.1f us\n"
+        "\tOver %d ms:\t\t%u of %u frames\n",
+            jitter->samples ? jitter->sum_ns / 1e3 / jitter->samples : 0.0,
+            jitter->max_ns / 1e3,
+            JITTER_LOG_THRESHOLD, jitter->over_threshold, jitter->samples);
+}
+
 static void omx_die(OMX_ERRORTYPE error, const char* message, ...) {
     va_list args;
     char str[1024];
@@ -371,47 +661,192 @@ static void dump_port(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL du
     }
 }
 
-// Some busy loops to verify we're running in order
-static void block_until_state_changed(OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState) {
-    OMX_STATETYPE eState;
-    int i = 0;
-    while(i++ == 0 || eState != wanted_eState) {
-        OMX_GetState(hComponent, &eState);
-        if(eState != wanted_eState) {
-            usleep(10000);
-        }
+// Fills in a buffer plan entry for a port from its port definition
+static void init_port_plan(buffer_plan *plan, const char *name, OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex) {
+    OMX_ERRORTYPE r;
+    OMX_PARAM_PORTDEFINITIONTYPE portdef;
+    OMX_INIT_STRUCTURE(portdef);
+    portdef.nPortIndex = nPortIndex;
+    if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+        omx_die(r, "Failed to get port definition for %s", name);
     }
+    plan->name = name;
+    plan->component = hComponent;
+    plan->port = nPortIndex;
+    plan->size = portdef.nBufferSize;
+    plan->count_min = portdef.nBufferCountMin;
+    plan->count_max = BUFFER_RING_SIZE;
 }
 
-static void block_until_port_changed(OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled) {
+// Shares the memory budget out among the pools. Each pool gets its minimum
+// number of buffers first, then the rest is handed out one buffer at a time
+// to each pool in turn. The buffer counts of the ports are set to the plan.
+static void plan_buffers(buffer_plan *plan, int plan_count, size_t budget) {
     OMX_ERRORTYPE r;
     OMX_PARAM_PORTDEFINITIONTYPE portdef;
-    OMX_INIT_STRUCTURE(portdef);
-    portdef.nPortIndex = nPortIndex;
-    OMX_U32 i = 0;
-    while(i++ == 0 || portdef.bEnabled != bEnabled) {
-        if((r = OMX_GetParameter(hComponent, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
-            omx_die(r, "Failed to get port definition");
+    size_t used = 0;
+    int i, added;
+    for(i = 0; i < plan_count; i++) {
+        plan[i].count = plan[i].count_min;
+        used += plan[i].size * plan[i].count;
+    }
+    if(used > budget) {
+        die("Memory budget of %zu bytes doesn't cover the %zu bytes of the minimum buffer counts", budget, used);
+    }
+    do {
+        added = 0;
+        for(i = 0; i < plan_count; i++) {
+            if(plan[i].count < plan[i].count_max && used + plan[i].size <= budget) {
+                plan[i].count++;
+                used += plan[i].size;
+                added = 1;
+            }
         }
-        if(portdef.bEnabled != bEnabled) {
-            usleep(10000);
+    } while(added);
+    say("Buffer plan for memory budget of %zu bytes:", budget);
+    for(i = 0; i < plan_count; i++) {
+        say("\t%s: %d buffers of %zu bytes, %zu bytes (%d .. %d buffers)",
+            plan[i].name, plan[i].count, plan[i].size, plan[i].size * plan[i].count, plan[i].count_min, plan[i].count_max);
+        if(!plan[i].component) {
+            continue;
         }
+        OMX_INIT_STRUCTURE(portdef);
+        portdef.nPortIndex = plan[i].port;
+        if((r = OMX_GetParameter(plan[i].component, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to get port definition for %s", plan[i].name);
+        }
+        portdef.nBufferCountActual = plan[i].count;
+        if((r = OMX_SetParameter(plan[i].component, OMX_IndexParamPortDefinition, &portdef)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to set buffer count for %s", plan[i].name);
+        }
+    }
+    say("\tTotal %zu bytes, %zu bytes left", used, budget - used);
+}
+
+// Called by the producer, i.e. an OMX callback
+static void buffer_ring_push(buffer_ring *ring, OMX_BUFFERHEADERTYPE *buffer) {
+    unsigned int head = ring->head;
+    if(head - ring->tail == BUFFER_RING_SIZE) {
+        die("Buffer ring is full");
     }
+    ring->buffers[head % BUFFER_RING_SIZE] = buffer;
+    // Make sure the entry is written before it's published
+    __sync_synchronize();
+    ring->head = head + 1;
 }
 
-static void block_until_flushed(appctx *ctx) {
-    int quit;
-    while(!quit) {
-        vcos_semaphore_wait(&ctx->handler_lock);
-        if(ctx->flushed) {
-            ctx->flushed = 0;
-            quit = 1;
+// Called by the consumer, i.e. the main loop, returns NULL if the ring is empty
+static OMX_BUFFERHEADERTYPE *buffer_ring_pop(buffer_ring *ring) {
+    unsigned int tail = ring->tail;
+    OMX_BUFFERHEADERTYPE *buffer;
+    if(tail == ring->head) {
+        return NULL;
+    }
+    // Make sure the entry is read only after seeing the new head,
+    // and read before the slot is handed back to the producer
+    __sync_synchronize();
+    buffer = ring->buffers[tail % BUFFER_RING_SIZE];
+    __sync_synchronize();
+    ring->tail = tail + 1;
+    return buffer;
+}
+
+// Convert a timeout relative to now to an absolute
+// CLOCK_MONOTONIC deadline for pthread_cond_timedwait()
+static void get_deadline(int timeout_ms, struct timespec *deadline) {
+    unsigned long long deadline_ns = get_time_ns() + timeout_ms * 1000000ULL;
+    deadline->tv_sec  = deadline_ns / 1000000000ULL;
+    deadline->tv_nsec = deadline_ns % 1000000000ULL;
+}
+
+// Wait until the event handler has received OMX_EventCmdComplete
+// for the given command, returns -1 if timeout_ms elapsed before that
+static int wait_for_command_complete(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2, int timeout_ms) {
+    struct timespec deadline;
+    int i, found = 0, timed_out = 0;
+    get_deadline(timeout_ms, &deadline);
+    pthread_mutex_lock(&ctx->command_lock);
+    while(1) {
+        for(i = 0; i < ctx->command_events_count; i++) {
+            omx_command_event *e = &ctx->command_events[i];
+            if(e->hComponent == hComponent && e->nCommand == nCommand && e->nData2 == nData2) {
+                // Consume the event so that it won't satisfy a later wait
+                *e = ctx->command_events[--ctx->command_events_count];
+                found = 1;
+                break;
+            }
+        }
+        if(found || timed_out) {
+            break;
         }
-        vcos_semaphore_post(&ctx->handler_lock);
-        if(!quit) {
-            usleep(10000);
+        timed_out = pthread_cond_timedwait(&ctx->command_cond, &ctx->command_lock, &deadline) == ETIMEDOUT;
+    }
+    pthread_mutex_unlock(&ctx->command_lock);
+    return found ? 0 : -1;
+}
+
+// Some blocking waits to verify we're running in order
+static void block_until_state_changed(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_STATETYPE wanted_eState, int timeout_ms) {
+    if(wait_for_command_complete(ctx, hComponent, OMX_CommandStateSet, wanted_eState, timeout_ms) != 0) {
+        die("Timed out after %d ms waiting for component 0x%08x to switch to state %d", timeout_ms, hComponent, wanted_eState);
+    }
+}
+
+static void block_until_port_changed(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_U32 nPortIndex, OMX_BOOL bEnabled, int timeout_ms) {
+    OMX_COMMANDTYPE nCommand = bEnabled ? OMX_CommandPortEnable : OMX_CommandPortDisable;
+    if(wait_for_command_complete(ctx, hComponent, nCommand, nPortIndex, timeout_ms) != 0) {
+        die("Timed out after %d ms waiting for port %d of component 0x%08x to be %s",
+            timeout_ms, nPortIndex, hComponent, bEnabled ? "enabled" : "disabled");
+    }
+}
+
+// Milliseconds left until the deadline, 0 if it has already passed
+static int get_remaining_ms(unsigned long long deadline_ns) {
+    unsigned long long now_ns = get_time_ns();
+    return now_ns < deadline_ns ? (deadline_ns - now_ns + 999999ULL) / 1000000ULL : 0;
+}
+
+// Wait for all the pending commands at once. They are carried out
+// concurrently by the components, so they share a single deadline.
+static void block_until_commands_complete(appctx *ctx, int timeout_ms) {
+    unsigned long long deadline_ns = get_time_ns() + timeout_ms * 1000000ULL;
+    int i;
+    for(i = 0; i < ctx->pending_commands_count; i++) {
+        omx_command_event *e = &ctx->pending_commands[i];
+        if(wait_for_command_complete(ctx, e->hComponent, e->nCommand, e->nData2, get_remaining_ms(deadline_ns)) != 0) {
+            die("Timed out after %d ms waiting for component 0x%08x to complete command %d for %d",
+                timeout_ms, e->hComponent, e->nCommand, e->nData2);
         }
     }
+    ctx->pending_commands_count = 0;
+}
+
+// Remember a command sent to a component so that it can be waited for
+// together with the others by block_until_commands_complete()
+static void add_pending_command(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2) {
+    if(ctx->pending_commands_count == MAX_PENDING_COMMANDS) {
+        die("Too many pending commands");
+    }
+    omx_command_event *e = &ctx->pending_commands[ctx->pending_commands_count++];
+    e->hComponent = hComponent;
+    e->nCommand = nCommand;
+    e->nData2 = nData2;
+}
+
+// Same for a startup command, which is waited for
+// right away without CONCURRENT_BRINGUP
+static void expect_command_complete(appctx *ctx, OMX_HANDLETYPE hComponent, OMX_COMMANDTYPE nCommand, OMX_U32 nData2) {
+    add_pending_command(ctx, hComponent, nCommand, nData2);
+    if(!CONCURRENT_BRINGUP) {
+        block_until_commands_complete(ctx, OMX_COMMAND_TIMEOUT);
+    }
+}
+
+// Log the time spent in a startup or teardown phase and start timing the next one
+static void end_phase(unsigned long long *phase_start_ns, const char *sequence, const char *phase) {
+    unsigned long long now_ns = get_time_ns();
+    say("%s phase %s took %.1f ms", sequence, phase, (now_ns - *phase_start_ns) / 1e6);
+    *phase_start_ns = now_ns;
 }
 
 static void init_component_handle(
@@ -451,7 +886,7 @@ static void init_component_handle(
                 if((r = OMX_SendCommand(*hComponent, OMX_CommandPortDisable, nPortIndex, NULL)) != OMX_ErrorNone) {
                     omx_die(r, "Failed to disable port %d of component %s", nPortIndex, fullname);
                 }
-                block_until_port_changed(*hComponent, nPortIndex, OMX_FALSE);
+                expect_command_complete((appctx *)pAppData, *hComponent, OMX_CommandPortDisable, nPortIndex);
             }
         }
     }
@@ -459,7 +894,13 @@ static void init_component_handle(
 
 // Global signal handler for trapping SIGINT, SIGTERM, and SIGQUIT
 static void signal_handler(int signal) {
+    int i;
     want_quit = 1;
+    for(i = 0; i < 2; i++) {
+        if(quit_semaphores[i]) {
+            vcos_semaphore_post(quit_semaphores[i]);
+        }
+    }
 }
 
 // OMX calls this handler for all the events it emits
@@ -470,6 +911,7 @@ static OMX_ERRORTYPE event_handler(
         OMX_U32 nData1,
         OMX_U32 nData2,
         OMX_PTR pEventData) {
+    configure_callback_thread();
 
     dump_event(hComponent, eEvent, nData1, nData2);
 
@@ -477,11 +919,17 @@ static OMX_ERRORTYPE event_handler(
 
     switch(eEvent) {
         case OMX_EventCmdComplete:
-            vcos_semaphore_wait(&ctx->handler_lock);
-            if(nData1 == OMX_CommandFlush) {
-                ctx->flushed = 1;
+            // Record the event for wait_for_command_complete()
+            pthread_mutex_lock(&ctx->command_lock);
+            if(ctx->command_events_count == MAX_COMMAND_EVENTS) {
+                die("Too many command complete events pending");
             }
-            vcos_semaphore_post(&ctx->handler_lock);
+            ctx->command_events[ctx->command_events_count].hComponent = hComponent;
+            ctx->command_events[ctx->command_events_count].nCommand   = nData1;
+            ctx->command_events[ctx->command_events_count].nData2     = nData2;
+            ctx->command_events_count++;
+            pthread_cond_broadcast(&ctx->command_cond);
+            pthread_mutex_unlock(&ctx->command_lock);
             break;
         case OMX_EventError:
             omx_die(nData1, "error event received");
@@ -493,17 +941,182 @@ static OMX_ERRORTYPE event_handler(
     return OMX_ErrorNone;
 }
 
+// Clears the parts of the buffer that reading the frame didn't write, that is
+// the padding below each plane and, after a short read at the end of the
+// file, the rest of the planes
+static void clear_input_padding(appctx *ctx, OMX_BUFFERHEADERTYPE *buffer, const i420_frame_info *frame_info, const i420_frame_info *buf_info, size_t input_total_read) {
+    size_t plane_start = 0, plane_size, written, buf_plane_size;
+    int plane_span_y = ROUND_UP_2(frame_info->height), plane_span_uv = plane_span_y / 2;
+    int i;
+    for(i = 0; i < 3; i++) {
+        plane_size = frame_info->p_stride[i] * (i == 0 ? plane_span_y : plane_span_uv);
+        buf_plane_size = (i < 2 ? buf_info->p_offset[i + 1] : buf_info->size) - buf_info->p_offset[i];
+        written = input_total_read > plane_start ? input_total_read - plane_start : 0;
+        if(written > plane_size) {
+            written = plane_size;
+        }
+        if(buf_plane_size > written) {
+            memset(buffer->pBuffer + buf_info->p_offset[i] + written, 0, buf_plane_size - written);
+            ctx->bytes_cleared += buf_plane_size - written;
+        }
+        plane_start += plane_size;
+    }
+}
+
+// Makes the buffer the empty last buffer of the stream. The encoder returns
+// an output buffer flagged with EOS once it has encoded all the frames
+// before it.
+static void mark_input_eos(OMX_BUFFERHEADERTYPE *buffer, int *eof, const char *reason) {
+    buffer->nFlags = OMX_BUFFERFLAG_EOS;
+    buffer->nOffset = 0;
+    buffer->nFilledLen = 0;
+    *eof = 1;
+    say("%s", reason);
+}
+
+// Copy the next frame of the mapped input file to the buffer, in one piece
+// if the frame has the layout of the buffer and plane by plane otherwise.
+// Returns the number of bytes read and sets eof at the end of the file.
+static size_t map_input_frame(appctx *ctx, OMX_BUFFERHEADERTYPE *buffer, const i420_frame_info *frame_info, const i420_frame_info *buf_info, int *eof) {
+    unsigned long long read_start_ns = get_time_ns();
+    size_t input_total_read = 0, want_read, input_read, available;
+    int plane_span_y = ROUND_UP_2(frame_info->height), plane_span_uv = plane_span_y / 2;
+    const unsigned char *src = ctx->input_map + ctx->input_offset;
+    int i;
+    buffer->nFlags = 0;
+    buffer->nOffset = 0;
+    available = ctx->input_size > ctx->input_offset ? ctx->input_size - ctx->input_offset : 0;
+    if(available > frame_info->size) {
+        available = frame_info->size;
+    }
+    if(want_quit) {
+        mark_input_eos(buffer, eof, "Quit requested, ending the input");
+        return 0;
+    }
+    if(available == 0) {
+        mark_input_eos(buffer, eof, "Input file EOF");
+        return 0;
+    }
+    if(ctx->input_same_layout && available == frame_info->size) {
+        memcpy(buffer->pBuffer, src, available);
+        input_total_read = available;
+        ctx->frames_copied_whole++;
+    } else {
+        for(i = 0; i < 3; i++) {
+            want_read = frame_info->p_stride[i] * (i == 0 ? plane_span_y : plane_span_uv);
+            input_read = available < want_read ? available : want_read;
+            memcpy(buffer->pBuffer + buf_info->p_offset[i], src, input_read);
+            src += input_read;
+            available -= input_read;
+            input_total_read += input_read;
+            if(input_read != want_read) {
+                buffer->nFlags = OMX_BUFFERFLAG_EOS;
+                *eof = 1;
+                say("Input file EOF");
+                break;
+            }
+        }
+        clear_input_padding(ctx, buffer, frame_info, buf_info, input_total_read);
+    }
+    ctx->input_offset += input_total_read;
+    buffer->nFilledLen = (buf_info->size - frame_info->size) + input_total_read;
+    ctx->frames_read++;
+    BUFFER_META(buffer)->frame_index = ctx->frames_read;
+    ctx->read_ns += get_time_ns() - read_start_ns;
+    say("Copied from the mapped input file to input buffer %d/%d, frame %d", buffer->nFilledLen, buffer->nAllocLen, ctx->frames_read);
+    return input_total_read;
+}
+
+// Pack Y, U, and V plane spans read from input file to the buffer,
+// returns the number of bytes read and sets eof at the end of the file.
+// The last buffer is flagged with EOS and passed to the encoder even if
+// it's empty.
+static size_t read_input_frame(appctx *ctx, OMX_BUFFERHEADERTYPE *buffer, const i420_frame_info *frame_info, const i420_frame_info *buf_info, int *eof) {
+    unsigned long long read_start_ns = get_time_ns();
+    size_t input_total_read = 0, want_read, input_read;
+    // I420 spec: U and V plane span size half of the size of the Y plane span size
+    int plane_span_y = ROUND_UP_2(frame_info->height), plane_span_uv = plane_span_y / 2;
+    int i;
+    if(ctx->input_mmap) {
+        return map_input_frame(ctx, buffer, frame_info, buf_info, eof);
+    }
+    if(want_quit) {
+        mark_input_eos(buffer, eof, "Quit requested, ending the input");
+        return 0;
+    }
+    buffer->nFlags = 0;
+    for(i = 0; i < 3; i++) {
+        want_read = frame_info->p_stride[i] * (i == 0 ? plane_span_y : plane_span_uv);
+        input_read = fread(
+            buffer->pBuffer + buf_info->p_offset[i],
+            1, want_read, ctx->fd_in);
+        input_total_read += input_read;
+        if(input_read != want_read) {
+            buffer->nFlags = OMX_BUFFERFLAG_EOS;
+            *eof = 1;
+            say("Input file EOF");
+            break;
+        }
+    }
+    // The empty last buffer just carries EOS and isn't counted as a frame,
+    // the same as in map_input_frame()
+    buffer->nOffset = 0;
+    if(input_total_read == 0) {
+        buffer->nFilledLen = 0;
+        return 0;
+    }
+    clear_input_padding(ctx, buffer, frame_info, buf_info, input_total_read);
+    buffer->nFilledLen = (buf_info->size - frame_info->size) + input_total_read;
+    ctx->frames_read++;
+    BUFFER_META(buffer)->frame_index = ctx->frames_read;
+    ctx->read_ns += get_time_ns() - read_start_ns;
+    say("Read from input file and wrote to input buffer %d/%d, frame %d", buffer->nFilledLen, buffer->nAllocLen, ctx->frames_read);
+    return input_total_read;
+}
+
+// Fills the input buffers as soon as the encoder has emptied them
+// and passes them to the main loop until the end of the input
+static void *input_reader_thread(void *arg) {
+    input_reader *reader = (input_reader*)arg;
+    appctx *ctx = reader->ctx;
+    OMX_BUFFERHEADERTYPE *buffer;
+    int eof = 0;
+    set_thread_scheduling("reader", READER_THREAD_POLICY, READER_THREAD_PRIORITY, READER_THREAD_CPU);
+    while(!eof) {
+        // The semaphore is posted once for each buffer pushed to the ring,
+        // and by the signal handler
+        vcos_semaphore_wait(&ctx->input_buffer_emptied);
+        if((buffer = buffer_ring_pop(&ctx->encoder_input_buffers_emptied)) == NULL) {
+            // The encoder holds all the buffers, don't wait for it after a signal
+            if(want_quit) {
+                break;
+            }
+            continue;
+        }
+        // The last buffer is passed on even if it's empty, it carries EOS
+        read_input_frame(ctx, buffer, &reader->frame_info, &reader->buf_info, &eof);
+        buffer_ring_push(&ctx->encoder_input_buffers_read, buffer);
+        vcos_semaphore_post(&ctx->buffer_done);
+    }
+    // Make sure the last buffer is published before the end of input
+    __sync_synchronize();
+    ctx->input_eof = 1;
+    vcos_semaphore_post(&ctx->buffer_done);
+    return NULL;
+}
+
 // Called by OMX when the encoder component requires
 // the input buffer to be filled with YUV video data
 static OMX_ERRORTYPE empty_input_buffer_done_handler(
         OMX_HANDLETYPE hComponent,
         OMX_PTR pAppData,
         OMX_BUFFERHEADERTYPE* pBuffer) {
+    configure_callback_thread();
     appctx *ctx = ((appctx*)pAppData);
-    vcos_semaphore_wait(&ctx->handler_lock);
-    // The main loop can now fill the buffer from input file
-    ctx->encoder_input_buffer_needed = 1;
-    vcos_semaphore_post(&ctx->handler_lock);
+    mark_buffer_dequeued(pBuffer);
+    // The reader thread or the main loop can now fill the buffer from input file
+    buffer_ring_push(&ctx->encoder_input_buffers_emptied, pBuffer);
+    vcos_semaphore_post(INPUT_READER_THREAD ? &ctx->input_buffer_emptied : &ctx->buffer_done);
     return OMX_ErrorNone;
 }
 
@@ -513,18 +1126,22 @@ static OMX_ERRORTYPE fill_output_buffer_done_handler(
         OMX_HANDLETYPE hComponent,
         OMX_PTR pAppData,
         OMX_BUFFERHEADERTYPE* pBuffer) {
+    configure_callback_thread();
     appctx *ctx = ((appctx*)pAppData);
-    vcos_semaphore_wait(&ctx->handler_lock);
+    mark_buffer_dequeued(pBuffer);
     // The main loop can now flush the buffer to output file
-    ctx->encoder_output_buffer_available = 1;
-    vcos_semaphore_post(&ctx->handler_lock);
+    buffer_ring_push(&ctx->encoder_output_buffers_filled, pBuffer);
+    vcos_semaphore_post(&ctx->buffer_done);
     return OMX_ErrorNone;
 }
 
 int main(int argc, char **argv) {
+    unsigned long long startup_ns = get_time_ns(), phase_ns = startup_ns;
+
     bcm_host_init();
 
     OMX_ERRORTYPE r;
+    int i;
 
     if((r = OMX_Init()) != OMX_ErrorNone) {
         omx_die(r, "OMX initalization failed");
@@ -533,18 +1150,31 @@ int main(int argc, char **argv) {
     // Init context
     appctx ctx;
     memset(&ctx, 0, sizeof(ctx));
-    if(vcos_semaphore_create(&ctx.handler_lock, "handler_lock", 1) != VCOS_SUCCESS) {
-        die("Failed to create handler lock semaphore");
+    if(vcos_semaphore_create(&ctx.buffer_done, "buffer_done", 0) != VCOS_SUCCESS) {
+        die("Failed to create buffer done semaphore");
+    }
+    if(vcos_semaphore_create(&ctx.input_buffer_emptied, "input_buffer_emptied", 0) != VCOS_SUCCESS) {
+        die("Failed to create input buffer emptied semaphore");
     }
+    pthread_condattr_t command_cond_attr;
+    pthread_condattr_init(&command_cond_attr);
+    pthread_condattr_setclock(&command_cond_attr, CLOCK_MONOTONIC);
+    if(pthread_mutex_init(&ctx.command_lock, NULL) != 0 || pthread_cond_init(&ctx.command_cond, &command_cond_attr) != 0) {
+        die("Failed to create command completion lock");
+    }
+    pthread_condattr_destroy(&command_cond_attr);
 
     // Init component handles
     OMX_CALLBACKTYPE callbacks;
-    memset(&ctx, 0, sizeof(callbacks));
+    memset(&callbacks, 0, sizeof(callbacks));
     callbacks.EventHandler    = event_handler;
     callbacks.EmptyBufferDone = empty_input_buffer_done_handler;
     callbacks.FillBufferDone  = fill_output_buffer_done_handler;
 
     init_component_handle("video_encode", &ctx.encoder, &ctx, &callbacks);
+    // Wait for the ports of all the components to be disabled at once
+    block_until_commands_complete(&ctx, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "component handles");
 
     say("Configuring encoder...");
 
@@ -565,6 +1195,10 @@ int main(int argc, char **argv) {
     // Stolen from gstomxvideodec.c of gst-omx
     encoder_portdef.format.video.nStride      = (encoder_portdef.format.video.nFrameWidth + encoder_portdef.nBufferAlignment - 1) & (~(encoder_portdef.nBufferAlignment - 1));
     encoder_portdef.format.video.eColorFormat = OMX_COLOR_FormatYUV420PackedPlanar;
+    // Let the input be read ahead to several buffers while the encoder is busy
+    if(encoder_portdef.nBufferCountActual < ENCODER_INPUT_BUFFERS) {
+        encoder_portdef.nBufferCountActual = ENCODER_INPUT_BUFFERS;
+    }
     if((r = OMX_SetParameter(ctx.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to set port definition for encoder input port 200");
     }
@@ -580,6 +1214,11 @@ int main(int argc, char **argv) {
     encoder_portdef.format.video.eCompressionFormat = OMX_VIDEO_CodingAVC;
     // Which one is effective, this or the configuration just below?
     encoder_portdef.format.video.nBitrate     = VIDEO_BITRATE;
+    // Keep a pool of buffers queued with the encoder so that it can carry
+    // on encoding while the main loop is flushing the previous buffers
+    if(encoder_portdef.nBufferCountActual < ENCODER_OUTPUT_BUFFERS) {
+        encoder_portdef.nBufferCountActual = ENCODER_OUTPUT_BUFFERS;
+    }
     if((r = OMX_SetParameter(ctx.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to set port definition for encoder output port 201");
     }
@@ -601,23 +1240,33 @@ int main(int argc, char **argv) {
         omx_die(r, "Failed to set video format for encoder output port 201");
     }
 
+    // Size the encoder buffers to fit in the memory budget
+    if(MEMORY_BUDGET) {
+        buffer_plan plan[2];
+        memset(plan, 0, sizeof(plan));
+        init_port_plan(&plan[0], "encoder input port 200", ctx.encoder, 200);
+        init_port_plan(&plan[1], "encoder output port 201", ctx.encoder, 201);
+        plan_buffers(plan, 2, MEMORY_BUDGET * 1024ULL * 1024ULL);
+    }
+
+    end_phase(&phase_ns, "Startup", "configuration");
+
     // Switch components to idle state
     say("Switching state of the encoder component to idle...");
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the encoder component to idle");
     }
-    block_until_state_changed(ctx.encoder, OMX_StateIdle);
+    block_until_state_changed(&ctx, ctx.encoder, OMX_StateIdle, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "idle");
 
     // Enable ports
     say("Enabling ports...");
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandPortEnable, 200, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable encoder input port 200");
     }
-    block_until_port_changed(ctx.encoder, 200, OMX_TRUE);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandPortEnable, 201, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to enable encoder output port 201");
     }
-    block_until_port_changed(ctx.encoder, 201, OMX_TRUE);
 
     // Allocate encoder input and output buffers
     say("Allocating buffers...");
@@ -626,17 +1275,77 @@ int main(int argc, char **argv) {
     if((r = OMX_GetParameter(ctx.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for encoder input port 200");
     }
-    if((r = OMX_AllocateBuffer(ctx.encoder, &ctx.encoder_ppBuffer_in, 200, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for encoder input port 200");
+    ctx.encoder_input_buffer_count = encoder_portdef.nBufferCountActual;
+    if(ctx.encoder_input_buffer_count > BUFFER_RING_SIZE) {
+        die("Encoder input buffer pool of %d buffers doesn't fit in the buffer ring", ctx.encoder_input_buffer_count);
     }
+    ctx.encoder_ppBuffer_in = calloc(ctx.encoder_input_buffer_count, sizeof(OMX_BUFFERHEADERTYPE*));
+    if(!ctx.encoder_ppBuffer_in) {
+        die("Failed to allocate encoder input buffer pool of %d buffers", ctx.encoder_input_buffer_count);
+    }
+    // A regular input file is mapped to memory as a whole instead of read,
+    // falling back to reading it if it doesn't fit in the address space
+    struct stat input_stat;
+    ctx.input_mmap = INPUT_MMAP && fstat(fileno(stdin), &input_stat) == 0 && S_ISREG(input_stat.st_mode);
+    if(ctx.input_mmap) {
+        ctx.input_size = input_stat.st_size;
+        ctx.input_map = mmap(NULL, ctx.input_size, PROT_READ, MAP_SHARED, fileno(stdin), 0);
+        if(ctx.input_map == MAP_FAILED) {
+            say("Failed to map input file of %lld bytes, reading it instead: %s", (long long)ctx.input_size, strerror(errno));
+            ctx.input_map = NULL;
+            ctx.input_mmap = 0;
+        } else {
+            madvise((void*)ctx.input_map, ctx.input_size, MADV_SEQUENTIAL);
+        }
+    }
+    // Locked frame memory needs the buffers to be our own
+    ctx.input_own_buffers = LOCKED_FRAME_MEMORY;
+    // All the buffers are sliced from a single allocation, page aligned each,
+    // so that the locked frame memory is rounded up to huge pages just once
+    size_t input_page_size = sysconf(_SC_PAGESIZE);
+    size_t input_buffer_stride = (encoder_portdef.nBufferSize + input_page_size - 1) & ~(input_page_size - 1);
+    if(ctx.input_own_buffers) {
+        ctx.encoder_input_memory = alloc_frame_memory(ctx.encoder_input_buffer_count * input_buffer_stride, &ctx.encoder_input_memory_mapped_size);
+        if(!ctx.encoder_input_memory) {
+            die("Failed to allocate %d buffers of %d bytes for encoder input port 200", ctx.encoder_input_buffer_count, encoder_portdef.nBufferSize);
+        }
+    }
+    ctx.encoder_input_buffer_meta = alloc_buffer_meta(ctx.encoder_input_buffer_count);
+    for(i = 0; i < ctx.encoder_input_buffer_count; i++) {
+        if(ctx.input_own_buffers) {
+            if((r = OMX_UseBuffer(ctx.encoder, &ctx.encoder_ppBuffer_in[i], 200, &ctx.encoder_input_buffer_meta[i], encoder_portdef.nBufferSize, ctx.encoder_input_memory + i * input_buffer_stride)) != OMX_ErrorNone) {
+                omx_die(r, "Failed to use buffer %d for encoder input port 200", i);
+            }
+        } else if((r = OMX_AllocateBuffer(ctx.encoder, &ctx.encoder_ppBuffer_in[i], 200, &ctx.encoder_input_buffer_meta[i], encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to allocate buffer %d for encoder input port 200", i);
+        }
+    }
+    say("Allocated %d buffers of %d bytes for encoder input port 200", ctx.encoder_input_buffer_count, encoder_portdef.nBufferSize);
     OMX_INIT_STRUCTURE(encoder_portdef);
     encoder_portdef.nPortIndex = 201;
     if((r = OMX_GetParameter(ctx.encoder, OMX_IndexParamPortDefinition, &encoder_portdef)) != OMX_ErrorNone) {
         omx_die(r, "Failed to get port definition for encoder output port 201");
     }
-    if((r = OMX_AllocateBuffer(ctx.encoder, &ctx.encoder_ppBuffer_out, 201, NULL, encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to allocate buffer for encoder output port 201");
+    ctx.encoder_output_buffer_count = encoder_portdef.nBufferCountActual;
+    if(ctx.encoder_output_buffer_count > BUFFER_RING_SIZE) {
+        die("Encoder output buffer pool of %d buffers doesn't fit in the buffer ring", ctx.encoder_output_buffer_count);
+    }
+    ctx.encoder_ppBuffer_out = calloc(ctx.encoder_output_buffer_count, sizeof(OMX_BUFFERHEADERTYPE*));
+    if(!ctx.encoder_ppBuffer_out) {
+        die("Failed to allocate encoder output buffer pool of %d buffers", ctx.encoder_output_buffer_count);
     }
+    ctx.encoder_output_buffer_meta = alloc_buffer_meta(ctx.encoder_output_buffer_count);
+    for(i = 0; i < ctx.encoder_output_buffer_count; i++) {
+        if((r = OMX_AllocateBuffer(ctx.encoder, &ctx.encoder_ppBuffer_out[i], 201, &ctx.encoder_output_buffer_meta[i], encoder_portdef.nBufferSize)) != OMX_ErrorNone) {
+            omx_die(r, "Failed to allocate buffer %d for encoder output port 201", i);
+        }
+    }
+    say("Allocated %d buffers of %d bytes for encoder output port 201", ctx.encoder_output_buffer_count, encoder_portdef.nBufferSize);
+
+    // Enabling a port completes only once it has been populated with buffers
+    block_until_port_changed(&ctx, ctx.encoder, 200, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    block_until_port_changed(&ctx, ctx.encoder, 201, OMX_TRUE, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "port enable");
 
     // Just use stdin for input and stdout for output
     say("Opening input and output files...");
@@ -649,7 +1358,8 @@ int main(int argc, char **argv) {
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandStateSet, OMX_StateExecuting, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the encoder component to executing");
     }
-    block_until_state_changed(ctx.encoder, OMX_StateExecuting);
+    block_until_state_changed(&ctx, ctx.encoder, OMX_StateExecuting, OMX_COMMAND_TIMEOUT);
+    end_phase(&phase_ns, "Startup", "executing");
 
     say("Configured port definition for encoder input port 200");
     dump_port(ctx.encoder, 200, OMX_FALSE);
@@ -663,87 +1373,160 @@ int main(int argc, char **argv) {
     dump_frame_info("Destination frame", &frame_info);
     dump_frame_info("Source buffer", &buf_info);
 
-    if(ctx.encoder_ppBuffer_in->nAllocLen != buf_info.size) {
-        die("Allocated encoder input port 200 buffer size %d doesn't equal to the expected buffer size %d", ctx.encoder_ppBuffer_in->nAllocLen, buf_info.size);
+    if(ctx.encoder_ppBuffer_in[0]->nAllocLen != buf_info.size) {
+        die("Allocated encoder input port 200 buffer size %d doesn't equal to the expected buffer size %d", ctx.encoder_ppBuffer_in[0]->nAllocLen, buf_info.size);
     }
 
+    // Frames of the input file can be copied to the buffers in one piece only
+    // when the stride and the slice height of the buffer match the frame
+    ctx.input_same_layout = ctx.input_mmap
+        && frame_info.size == buf_info.size
+        && !memcmp(frame_info.p_offset, buf_info.p_offset, sizeof(frame_info.p_offset))
+        && !memcmp(frame_info.p_stride, buf_info.p_stride, sizeof(frame_info.p_stride));
+    if(ctx.input_mmap) {
+        say("Mapping input file of %lld bytes, %s", (long long)ctx.input_size, ctx.input_same_layout ? "copying whole frames to the buffers" : "copying frames to the buffers plane by plane");
+    }
+
+    set_thread_scheduling("main", MAIN_THREAD_POLICY, MAIN_THREAD_PRIORITY, MAIN_THREAD_CPU);
+    jitter_stats jitter;
+    memset(&jitter, 0, sizeof(jitter));
+    long minor_faults_start, major_faults_start, minor_faults, major_faults;
+    get_page_faults(&minor_faults_start, &major_faults_start);
+
     say("Enter encode loop, press Ctrl-C to quit...");
 
-    int input_available = 1, frame_in = 0, frame_out = 0, i;
-    size_t input_total_read, want_read, input_read, output_written;
-    // I420 spec: U and V plane span size half of the size of the Y plane span size
-    int plane_span_y = ROUND_UP_2(frame_info.height), plane_span_uv = plane_span_y / 2;
+    int input_done = 0, frame_out = 0, slice_out = 0, eof = 0, eos = 0;
+    OMX_BUFFERHEADERTYPE *buffer;
+    size_t output_written;
+    unsigned long long loop_start_ns, loop_ns;
+    input_reader reader;
+
+    // All the input buffers start out empty, nothing else
+    // pushes to the ring before they are passed to the encoder
+    for(i = 0; i < ctx.encoder_input_buffer_count; i++) {
+        buffer_ring_push(&ctx.encoder_input_buffers_emptied, ctx.encoder_ppBuffer_in[i]);
+        vcos_semaphore_post(INPUT_READER_THREAD ? &ctx.input_buffer_emptied : &ctx.buffer_done);
+    }
 
-    ctx.encoder_input_buffer_needed = 1;
+    // Hand all the output buffers to the encoder component,
+    // each one is requeued as soon as it has been flushed
+    for(i = 0; i < ctx.encoder_output_buffer_count; i++) {
+        mark_buffer_enqueued(ctx.encoder_ppBuffer_out[i]);
+        if((r = OMX_FillThisBuffer(ctx.encoder, ctx.encoder_ppBuffer_out[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to request filling of the output buffer %d on encoder output port 201", i);
+        }
+    }
 
+    quit_semaphores[0] = &ctx.buffer_done;
+    quit_semaphores[1] = &ctx.input_buffer_emptied;
     signal(SIGINT,  signal_handler);
     signal(SIGTERM, signal_handler);
     signal(SIGQUIT, signal_handler);
 
+    loop_start_ns = get_time_ns();
+
+    if(INPUT_READER_THREAD) {
+        reader.ctx = &ctx;
+        reader.frame_info = frame_info;
+        reader.buf_info = buf_info;
+        if(pthread_create(&reader.thread, NULL, input_reader_thread, &reader) != 0) {
+            die("Failed to create reader thread");
+        }
+    }
+
     while(1) {
-        // empty_input_buffer_done_handler() has marked that there's
-        // a need for a buffer to be filled by us
-        if(ctx.encoder_input_buffer_needed && input_available) {
-            input_total_read = 0;
-            memset(ctx.encoder_ppBuffer_in->pBuffer, 0, ctx.encoder_ppBuffer_in->nAllocLen);
-            // Pack Y, U, and V plane spans read from input file to the buffer
-            for(i = 0; i < 3; i++) {
-                want_read = frame_info.p_stride[i] * (i == 0 ? plane_span_y : plane_span_uv);
-                input_read = fread(
-                    ctx.encoder_ppBuffer_in->pBuffer + buf_info.p_offset[i],
-                    1, want_read, ctx.fd_in);
-                input_total_read += input_read;
-                if(input_read != want_read) {
-                    ctx.encoder_ppBuffer_in->nFlags = OMX_BUFFERFLAG_EOS;
-                    want_quit = 1;
-                    say("Input file EOF");
-                    break;
+        if(INPUT_READER_THREAD) {
+            // The reader thread passes the filled input buffers through the ring,
+            // the input is done once it has reached the end and the ring is empty
+            eof = ctx.input_eof;
+            __sync_synchronize();
+            while((buffer = buffer_ring_pop(&ctx.encoder_input_buffers_read)) != NULL) {
+                mark_buffer_enqueued(buffer);
+                if((r = OMX_EmptyThisBuffer(ctx.encoder, buffer)) != OMX_ErrorNone) {
+                    omx_die(r, "Failed to request emptying of the input buffer on encoder input port 200");
                 }
             }
-            ctx.encoder_ppBuffer_in->nOffset = 0;
-            ctx.encoder_ppBuffer_in->nFilledLen = (buf_info.size - frame_info.size) + input_total_read;
-            frame_in++;
-            say("Read from input file and wrote to input buffer %d/%d, frame %d", ctx.encoder_ppBuffer_in->nFilledLen, ctx.encoder_ppBuffer_in->nAllocLen, frame_in);
-            // Mark input unavailable also if the signal handler was triggered
-            if(want_quit) {
-                input_available = 0;
-            }
-            if(input_total_read > 0) {
-                ctx.encoder_input_buffer_needed = 0;
-                if((r = OMX_EmptyThisBuffer(ctx.encoder, ctx.encoder_ppBuffer_in)) != OMX_ErrorNone) {
+            input_done = eof;
+        } else {
+            // empty_input_buffer_done_handler() passes the input buffers
+            // back to us through the ring when they need to be filled again
+            while(!input_done && (buffer = buffer_ring_pop(&ctx.encoder_input_buffers_emptied)) != NULL) {
+                // The input is also ended with an empty buffer flagged with
+                // EOS if the signal handler was triggered
+                read_input_frame(&ctx, buffer, &frame_info, &buf_info, &eof);
+                mark_buffer_enqueued(buffer);
+                if((r = OMX_EmptyThisBuffer(ctx.encoder, buffer)) != OMX_ErrorNone) {
                     omx_die(r, "Failed to request emptying of the input buffer on encoder input port 200");
                 }
+                input_done = eof;
             }
         }
-        // fill_output_buffer_done_handler() has marked that there's
-        // a buffer for us to flush
-        if(ctx.encoder_output_buffer_available) {
-            if(ctx.encoder_ppBuffer_out->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) {
+        // fill_output_buffer_done_handler() passes the buffers
+        // filled by the encoder to us through the ring
+        while((buffer = buffer_ring_pop(&ctx.encoder_output_buffers_filled)) != NULL) {
+            BUFFER_META(buffer)->frame_index = frame_out + 1;
+            BUFFER_META(buffer)->slice_index = slice_out++;
+            // The codec config buffers in the beginning and the empty EOS
+            // buffer in the end are flagged as whole frames too
+            if((buffer->nFlags & OMX_BUFFERFLAG_ENDOFFRAME) && !(buffer->nFlags & OMX_BUFFERFLAG_CODECCONFIG) && buffer->nFilledLen) {
+                if(!frame_out) {
+                    say("Startup to first encoded frame took %.1f ms", (get_time_ns() - startup_ns) / 1e6);
+                }
                 frame_out++;
+                slice_out = 0;
+                add_frame_arrival(&jitter);
             }
             // Flush buffer to output file
-            output_written = fwrite(ctx.encoder_ppBuffer_out->pBuffer + ctx.encoder_ppBuffer_out->nOffset, 1, ctx.encoder_ppBuffer_out->nFilledLen, ctx.fd_out);
-            if(output_written != ctx.encoder_ppBuffer_out->nFilledLen) {
+            output_written = fwrite(buffer->pBuffer + buffer->nOffset, 1, buffer->nFilledLen, ctx.fd_out);
+            if(output_written != buffer->nFilledLen) {
                 die("Failed to write to output file: %s", strerror(errno));
             }
-            say("Read from output buffer and wrote to output file %d/%d, frame %d", ctx.encoder_ppBuffer_out->nFilledLen, ctx.encoder_ppBuffer_out->nAllocLen, frame_out + 1);
-        }
-        if(ctx.encoder_output_buffer_available || !frame_out) {
-            // Buffer flushed, request a new buffer to be filled by the encoder component
-            ctx.encoder_output_buffer_available = 0;
-            if((r = OMX_FillThisBuffer(ctx.encoder, ctx.encoder_ppBuffer_out)) != OMX_ErrorNone) {
+            say("Read from output buffer %d and wrote to output file %d/%d, frame %d slice %d, timestamp %lld us, %.1f ms with the encoder, %.1f ms waiting to be written",
+                BUFFER_META(buffer)->buffer_index, buffer->nFilledLen, buffer->nAllocLen,
+                BUFFER_META(buffer)->frame_index, BUFFER_META(buffer)->slice_index,
+                get_timestamp_us(BUFFER_META(buffer)->timestamp),
+                (BUFFER_META(buffer)->dequeue_ns - BUFFER_META(buffer)->enqueue_ns) / 1e6,
+                (get_time_ns() - BUFFER_META(buffer)->dequeue_ns) / 1e6);
+            if(buffer->nFlags & OMX_BUFFERFLAG_EOS) {
+                eos = 1;
+            }
+            // Buffer flushed, request it to be filled again by the encoder component
+            mark_buffer_enqueued(buffer);
+            if((r = OMX_FillThisBuffer(ctx.encoder, buffer)) != OMX_ErrorNone) {
                 omx_die(r, "Failed to request filling of the output buffer on encoder output port 201");
             }
         }
-        // Don't exit the loop until all the input frames have been encoded.
-        // Out frame count is larger than in frame count because 2 header
-        // frames are emitted in the beginning.
-        if(want_quit && frame_out == frame_in) {
+        // Don't exit the loop until all the input frames have been encoded,
+        // that is until the encoder has returned the end of the stream
+        if(eos) {
+            break;
+        }
+        // Sleep until one of the buffer done handlers wakes us up. Once the
+        // input is done or a signal has been caught, give up if the encoder
+        // doesn't return anything for TEARDOWN_TIMEOUT.
+        if(!input_done && !want_quit) {
+            vcos_semaphore_wait(&ctx.buffer_done);
+        } else if(vcos_semaphore_wait_timeout(&ctx.buffer_done, TEARDOWN_TIMEOUT) != VCOS_SUCCESS) {
+            say("Encoder didn't return the end of the stream in %d ms", TEARDOWN_TIMEOUT);
             break;
         }
-        // Would be better to use signaling here but hey this works too
-        usleep(10);
     }
+    loop_ns = get_time_ns() - loop_start_ns;
+    if(INPUT_READER_THREAD) {
+        pthread_join(reader.thread, NULL);
+    }
+    get_page_faults(&minor_faults, &major_faults);
+    say("Encoded %d frames in %.3f s, %.1f fps, %.3f s spent reading input %s",
+        frame_out, loop_ns / 1e9, loop_ns ? frame_out * 1e9 / loop_ns : 0.0, ctx.read_ns / 1e9,
+        INPUT_READER_THREAD ? "in the reader thread" : "in the encode loop");
+    if(ctx.input_mmap) {
+        say("Copied %d of %d frames from the mapped input file in one piece", ctx.frames_copied_whole, ctx.frames_read);
+    }
+    say("Cleared %llu bytes of input buffer padding, %llu bytes per frame",
+        ctx.bytes_cleared, ctx.frames_read ? ctx.bytes_cleared / ctx.frames_read : 0);
+    say("Page faults in the encode loop: %ld minor, %ld major, %ld minor and %ld major in total",
+        minor_faults - minor_faults_start, major_faults - major_faults_start, minor_faults, major_faults);
+    dump_jitter_stats(&jitter);
     say("Cleaning up...");
 
     // Restore signal handlers
@@ -751,54 +1534,90 @@ int main(int argc, char **argv) {
     signal(SIGTERM, SIG_DFL);
     signal(SIGQUIT, SIG_DFL);
 
+    // Tear down all the components at once, all the steps
+    // together have to complete within TEARDOWN_TIMEOUT
+    unsigned long long teardown_ns = get_time_ns();
+    unsigned long long teardown_deadline_ns = teardown_ns + TEARDOWN_TIMEOUT * 1000000ULL;
+    phase_ns = teardown_ns;
+
     // Flush the buffers on each component
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandFlush, 200, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of encoder input port 200");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandFlush, 200);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandFlush, 201, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to flush buffers of encoder output port 201");
     }
-    block_until_flushed(&ctx);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandFlush, 201);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "flush");
 
     // Disable all the ports
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandPortDisable, 200, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable encoder input port 200");
     }
-    block_until_port_changed(ctx.encoder, 200, OMX_FALSE);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandPortDisable, 200);
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandPortDisable, 201, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to disable encoder output port 201");
     }
-    block_until_port_changed(ctx.encoder, 201, OMX_FALSE);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandPortDisable, 201);
 
     // Free all the buffers
-    if((r = OMX_FreeBuffer(ctx.encoder, 200, ctx.encoder_ppBuffer_in)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for encoder input port 200");
+    for(i = 0; i < ctx.encoder_input_buffer_count; i++) {
+        if((r = OMX_FreeBuffer(ctx.encoder, 200, ctx.encoder_ppBuffer_in[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to free buffer %d for encoder input port 200", i);
+        }
+    }
+    free(ctx.encoder_ppBuffer_in);
+    free(ctx.encoder_input_buffer_meta);
+    if(ctx.input_own_buffers) {
+        free_frame_memory(ctx.encoder_input_memory, ctx.encoder_input_memory_mapped_size);
     }
-    if((r = OMX_FreeBuffer(ctx.encoder, 201, ctx.encoder_ppBuffer_out)) != OMX_ErrorNone) {
-        omx_die(r, "Failed to free buffer for encoder output port 201");
+    if(ctx.input_map) {
+        munmap((void*)ctx.input_map, ctx.input_size);
     }
+    for(i = 0; i < ctx.encoder_output_buffer_count; i++) {
+        if((r = OMX_FreeBuffer(ctx.encoder, 201, ctx.encoder_ppBuffer_out[i])) != OMX_ErrorNone) {
+            omx_die(r, "Failed to free buffer %d for encoder output port 201", i);
+        }
+    }
+    free(ctx.encoder_ppBuffer_out);
+    free(ctx.encoder_output_buffer_meta);
+
+    // Disabling a port completes only once its buffers have been freed
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "disable");
 
-    // Transition all the components to idle and then to loaded states
+    // Transition all the components to idle and then to loaded states,
+    // all of them are idle before any of them is switched to loaded
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandStateSet, OMX_StateIdle, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the encoder component to idle");
     }
-    block_until_state_changed(ctx.encoder, OMX_StateIdle);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandStateSet, OMX_StateIdle);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "idle");
     if((r = OMX_SendCommand(ctx.encoder, OMX_CommandStateSet, OMX_StateLoaded, NULL)) != OMX_ErrorNone) {
         omx_die(r, "Failed to switch state of the encoder component to loaded");
     }
-    block_until_state_changed(ctx.encoder, OMX_StateLoaded);
+    add_pending_command(&ctx, ctx.encoder, OMX_CommandStateSet, OMX_StateLoaded);
+    block_until_commands_complete(&ctx, get_remaining_ms(teardown_deadline_ns));
+    end_phase(&phase_ns, "Teardown", "loaded");
 
     // Free the component handles
     if((r = OMX_FreeHandle(ctx.encoder)) != OMX_ErrorNone) {
         omx_die(r, "Failed to free encoder component handle");
     }
+    end_phase(&phase_ns, "Teardown", "free handles");
+    say("Teardown took %.1f ms", (get_time_ns() - teardown_ns) / 1e6);
 
     // Exit
     fclose(ctx.fd_in);
     fclose(ctx.fd_out);
 
-    vcos_semaphore_delete(&ctx.handler_lock);
+    pthread_cond_destroy(&ctx.command_cond);
+    pthread_mutex_destroy(&ctx.command_lock);
+    vcos_semaphore_delete(&ctx.input_buffer_emptied);
+    vcos_semaphore_delete(&ctx.buffer_done);
     if((r = OMX_Deinit()) != OMX_ErrorNone) {
         omx_die(r, "OMX de-initalization failed");
     }